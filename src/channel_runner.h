@@ -4,6 +4,8 @@
 #include <boost/range/algorithm/for_each.hpp>
 #include "communication/communicator.h"
 #include "communication/backend_mpi.h"
+#include "communication/backend_shmem.h"
+#include "communication/backend_loopback.h"
 #include <cereal/types/array.hpp>
 #include "router.h"
 #include "data.h"
@@ -13,32 +15,71 @@ namespace ib_bench {
 namespace mpi = boost::mpi;
 
 /// Async-sends all to all (or some to some, depending on the routing table),
-/// via independent channels
-template <class... ChannelTypes>
-struct channel_runner {
+/// via independent channels, over any backend
+template <class Backend, class... ChannelTypes>
+struct basic_channel_runner {
 
     using channel_priorities = std::array<size_t, sizeof...(ChannelTypes)>;
+    using comm_t = SRCommunicator<Backend, ChannelTypes...>;
+    /// Max messages received from a channel at once
+    static constexpr size_t RECV_BATCH_SIZE = 64;
 
-    channel_runner(
+    basic_channel_runner(
+        size_t iters_to_run,
+        const flush_config& flush,
+        size_t iters_to_sync,
+        const channel_priorities& channel_priorities,
+        router::routing_table routing_table,
+        receive_mode recv_mode = receive_mode::queue
+    ) :
+        basic_channel_runner(
+            std::make_unique<Backend>(flush),
+            iters_to_run,
+            iters_to_sync,
+            channel_priorities,
+            std::move(routing_table),
+            recv_mode
+        )
+    { }
+
+    /// Runs over a backend that the caller constructed
+    basic_channel_runner(
+        std::unique_ptr<Backend> backend,
         size_t iters_to_run,
-        size_t flush_size,
         size_t iters_to_sync,
         const channel_priorities& channel_priorities,
-        router::routing_table routing_table
+        router::routing_table routing_table,
+        receive_mode recv_mode = receive_mode::queue
     ) :
-        m_comm(flush_size),
-        m_comm_size(mpi::communicator{}.size()),
+        m_comm(std::move(backend)),
+        m_comm_size(m_comm.size()),
         m_iters_to_run(iters_to_run),
         m_iters_to_sync(iters_to_sync),
         m_channel_priorities(channel_priorities),
-        m_router((size_t)m_comm.size(), (size_t)m_comm.rank(), std::move(routing_table))
+        m_router((size_t)m_comm.size(), (size_t)m_comm.rank(), std::move(routing_table)),
+        m_recv_mode(recv_mode)
     {
         std::srand(0);
+        // a channel that generates more messages gets a bigger share of the send path
+        std::array<size_t, sizeof...(ChannelTypes)> weights;
+        for (size_t i = 0; i < weights.size(); ++i) {
+            weights[i] = 1 + m_channel_priorities[i];
+        }
+        m_comm.set_channel_weights(weights);
+        if (m_recv_mode == receive_mode::handler) {
+            set_receive_handlers();
+        }
     }
 
+    // all channels synchronize concurrently
     void sync() {
         auto per_channel = [=]<size_t... Is>(std::index_sequence<Is...>) {
-            (..., m_comm.template synchronize<Is>());
+            std::array<sync_handle, sizeof...(Is)> handles = {
+                m_comm.template begin_synchronize<Is>()...
+            };
+            for (auto& handle : handles) {
+                m_comm.wait_synchronize(handle);
+            }
         };
         per_channel(std::index_sequence_for<ChannelTypes...>{});
     }
@@ -68,9 +109,27 @@ struct channel_runner {
         per_channel(std::index_sequence_for<ChannelTypes...>{});
     }
 
+    // the payload is only dropped, so views save deserializing it. Draining
+    // in batches locks the receive queue once per batch.
     template <size_t PORT, typename T>
     void receive_channel() {
-        m_comm.template try_receive<PORT>();
+        thread_local std::vector<typename comm_t::template view_t<PORT>> views;
+        m_comm.template try_receive_view_bulk<PORT>(std::back_inserter(views),
+                                                    RECV_BATCH_SIZE);
+        for (auto& view : views) {
+            m_stats.update_received(view.bytes().size());
+        }
+        views.clear();
+    }
+
+    // receive_mode::handler - the communicator's loop drops the payloads
+    void set_receive_handlers() {
+        auto per_channel = [=]<size_t... Is>(std::index_sequence<Is...>) {
+            (..., m_comm.template set_receive_handler<Is>([this](auto&& view) {
+                m_stats.update_received(view.bytes().size());
+            }));
+        };
+        per_channel(std::index_sequence_for<ChannelTypes...>{});
     }
 
     void receive() {
@@ -98,8 +157,9 @@ struct channel_runner {
         };
 
         auto receive = [&]() {
-            while (!m_stopped) {
+            while (!m_stopped && m_recv_mode == receive_mode::queue) {
                 this->receive();
+                m_comm.wait_recv();
             }
             BENCH_LOG_DEBUG(boost::format("[%d] recv exit") % m_comm.rank());
         };
@@ -115,18 +175,33 @@ struct channel_runner {
         receiver.join();
         std::cout << "Rank " << m_comm.rank() << " sent " << (m_stats.bytes_sent() / 1024) <<
             " KB " << m_stats.seconds_passed() << " sec " << (m_stats.upstream_bandwidth() / 1024 / 1024) << " MB/s" << std::endl;
+        std::cout << "Rank " << m_comm.rank() << " received " << m_stats.msgs_received() <<
+            " msgs " << (m_stats.downstream_msg_rate() / 1e6) << " Mmsg/s (" <<
+            (m_recv_mode == receive_mode::queue ? "queue" : "handler") << " mode)" << std::endl;
     }
 
 private:
-    SRCommunicator<MPIBackend, ChannelTypes...> m_comm;
+    comm_t m_comm;
     size_t m_comm_size;
     size_t m_iters_to_run;
     size_t m_iters_to_sync;
     std::atomic_bool m_stopped;
     channel_priorities m_channel_priorities;
     router m_router;
+    receive_mode m_recv_mode;
     NetStats m_stats;
 };
 
+template <class... ChannelTypes>
+using channel_runner = basic_channel_runner<MPIBackend, ChannelTypes...>;
+
+/// The same workloads over one-sided OpenSHMEM puts
+template <class... ChannelTypes>
+using shmem_channel_runner = basic_channel_runner<ShmemBackend, ChannelTypes...>;
+
+/// The same workloads between threads of this process, no network involved
+template <class... ChannelTypes>
+using loopback_channel_runner = basic_channel_runner<LoopbackBackend, ChannelTypes...>;
+
 }
 
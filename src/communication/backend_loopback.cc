@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <thread>
+#include <boost/format.hpp>
+#include <util/log.h>
+#include <util/validate.h>
+#include "backend_loopback.h"
+
+namespace ib_bench {
+
+loopback_world::loopback_world(size_t ranks, size_t inbox_batches) :
+    m_names(ranks)
+{
+    VALIDATE(ranks > 0, "A loopback world needs at least one rank");
+    for (size_t i = 0; i < ranks; ++i) {
+        m_inboxes.push_back(std::make_unique<inboxes>(inbox_batches));
+    }
+}
+
+size_t loopback_world::size() const {
+    return m_inboxes.size();
+}
+
+auto loopback_world::data_inbox(size_t rank) -> inbox_t& {
+    return m_inboxes[rank]->data;
+}
+
+auto loopback_world::ctrl_inbox(size_t rank) -> inbox_t& {
+    return m_inboxes[rank]->ctrl;
+}
+
+void loopback_world::barrier() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    size_t generation = m_generation;
+    if (++m_arrived == size()) {
+        m_arrived = 0;
+        ++m_generation;
+        m_cond.notify_all();
+        return;
+    }
+    m_cond.wait(lock, [&] { return m_generation != generation; });
+}
+
+bool loopback_world::all_equal(size_t rank, const std::string& name) {
+    m_names[rank] = name;
+    barrier();
+    bool rv = std::all_of(m_names.begin(), m_names.end(),
+                          [&](const std::string& other) { return other == name; });
+    // nobody overwrites a name before everyone compared
+    barrier();
+    return rv;
+}
+
+LoopbackBackend::LoopbackBackend(loopback_world& world, size_t rank, const flush_config& flush) :
+    m_world(world),
+    m_rank(rank),
+    m_send_buffers(size()),
+    m_buffered_bytes(size(), 0),
+    m_flush(flush, size()),
+    m_outstanding_bytes(size()),
+    m_max_outstanding(flush.max_outstanding_bytes),
+    m_pending_data(size()),
+    m_pending_ctrl(size())
+{
+    VALIDATE(m_rank < size(), "Rank " << m_rank << " is out of the loopback world");
+    m_recv_batches.reserve(RECV_BATCHES);
+}
+
+LoopbackBackend::~LoopbackBackend() {
+    // Sync all ranks before closing
+    flush_send_buffers();
+    BENCH_LOG_DEBUG("Communicator loopback backend waiting for all ranks to finish");
+    m_world.barrier();
+}
+
+void LoopbackBackend::validate_frontend_type(const std::string& type_name) {
+    BENCH_LOG_DEBUG(
+        boost::format("[%d] Validating comm frontend type") % rank());
+    bool match = m_world.all_equal(m_rank, type_name);
+    if (rank() == 0 && !match) {
+        throw std::runtime_error("Fatal error! Communicator types of "
+                                 "different nodes do not match!");
+    }
+    if (rank() == 0) {
+        BENCH_LOG_DEBUG("[0] Comm type validation successful");
+    }
+}
+
+void LoopbackBackend::drain(inbox_t& inbox, std::deque<batch_t>& pending) {
+    while (!pending.empty() && inbox.try_push(pending.front())) {
+        pending.pop_front();
+        --m_pending_batches;
+    }
+}
+
+void LoopbackBackend::drain_all() {
+    if (m_pending_batches == 0) {
+        return;
+    }
+    for (size_t dest = 0; dest < size(); ++dest) {
+        drain(m_world.ctrl_inbox(dest), m_pending_ctrl[dest]);
+        drain(m_world.data_inbox(dest), m_pending_data[dest]);
+    }
+}
+
+void LoopbackBackend::submit(inbox_t& inbox, std::deque<batch_t>& pending, batch_t&& batch) {
+    pending.push_back(std::move(batch));
+    ++m_pending_batches;
+    drain(inbox, pending);
+}
+
+void LoopbackBackend::send(frame_t frame, size_t dest) {
+    size_t frame_bytes = frame.payload.size() + sizeof(wire_header);
+    m_send_buffers[dest].push_back(std::move(frame));
+    m_buffered_bytes[dest] += frame_bytes;
+    if (m_flush.on_buffered(dest, frame_bytes)) {
+        flush_one_buffer(dest);
+    }
+}
+
+void LoopbackBackend::send_slice(const wire_slice& slice, size_t dest) {
+    // the batch carries frames to the receiver as they are
+    send(frame_t{slice.header, msg_t(slice.data, slice.length)}, dest);
+}
+
+void LoopbackBackend::flush_one_buffer(size_t buffer_num) {
+    // If there's nothing to flush, save water!
+    if (m_send_buffers[buffer_num].empty()) {
+        return;
+    }
+    batch_t batch;
+    batch.frames.reserve(m_send_buffers[buffer_num].size());
+    batch.frames.swap(m_send_buffers[buffer_num]);
+    batch.bytes = std::exchange(m_buffered_bytes[buffer_num], 0);
+    // counted before the push, the receiver may take it at once
+    batch.outstanding = &m_outstanding_bytes[buffer_num];
+    batch.outstanding->fetch_add(batch.bytes, std::memory_order_relaxed);
+    submit(m_world.data_inbox(buffer_num), m_pending_data[buffer_num], std::move(batch));
+    m_flush.on_flushed(buffer_num, m_pending_batches);
+}
+
+void LoopbackBackend::send_control(const frame_t& frame, size_t dest) {
+    batch_t batch;
+    batch.frames.push_back(frame);
+    submit(m_world.ctrl_inbox(dest), m_pending_ctrl[dest], std::move(batch));
+}
+
+void LoopbackBackend::flush_send_buffer(size_t dest) {
+    flush_one_buffer(dest);
+    m_flush.update_deadline();
+}
+
+void LoopbackBackend::flush_send_buffers() {
+    for (size_t i = 0; i < size(); ++i) {
+        flush_one_buffer(i);
+    }
+    m_flush.update_deadline();
+}
+
+void LoopbackBackend::flush_expired_buffers() {
+    double now = flush_policy::now();
+    if (!m_flush.any_expired(now)) {
+        return;
+    }
+    for (size_t i = 0; i < size(); ++i) {
+        if (m_flush.expired(i, now)) {
+            flush_one_buffer(i);
+        }
+    }
+    m_flush.update_deadline();
+}
+
+bool LoopbackBackend::done_sending() {
+    // a pushed batch is delivered, only the waiting ones remain
+    drain_all();
+    return m_pending_batches == 0;
+}
+
+bool LoopbackBackend::may_send(size_t dest) {
+    drain(m_world.data_inbox(dest), m_pending_data[dest]);
+    if (!m_pending_data[dest].empty()) {
+        return false;
+    }
+    return m_max_outstanding == 0 ||
+        m_outstanding_bytes[dest].load(std::memory_order_relaxed) < m_max_outstanding;
+}
+
+void LoopbackBackend::receive(inbox_t& inbox, std::vector<frame_t>& out) {
+    inbox.try_pop_bulk(std::back_inserter(m_recv_batches), RECV_BATCHES);
+    for (auto& batch : m_recv_batches) {
+        if (batch.outstanding) {
+            batch.outstanding->fetch_sub(batch.bytes, std::memory_order_relaxed);
+        }
+        if (out.empty()) {
+            out = std::move(batch.frames);
+        } else {
+            out.insert(out.end(), std::make_move_iterator(batch.frames.begin()),
+                       std::make_move_iterator(batch.frames.end()));
+        }
+    }
+    m_recv_batches.clear();
+}
+
+std::optional<std::vector<LoopbackBackend::frame_t>> LoopbackBackend::try_receive() {
+    // Batches that waited for room go first, the receivers may have made some
+    drain_all();
+    std::vector<frame_t> rv;
+    // Control frames first, they don't wait behind the data
+    receive(m_world.ctrl_inbox(m_rank), rv);
+    receive(m_world.data_inbox(m_rank), rv);
+    if (rv.empty()) {
+        // let the other ranks' threads run
+        std::this_thread::yield();
+        return std::nullopt;
+    }
+    return rv;
+}
+
+void LoopbackBackend::broadcast(const frame_t& frame) {
+    for (size_t i = 0; i < size(); ++i) {
+        send(frame, i);
+    }
+}
+
+bool LoopbackBackend::concurrent_send() const {
+    return false;
+}
+
+size_t LoopbackBackend::rank() const {
+    return m_rank;
+}
+
+size_t LoopbackBackend::size() const {
+    return m_world.size();
+}
+
+}
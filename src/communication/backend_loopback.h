@@ -0,0 +1,185 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+#include <utility>
+#include <util/mpsc_ring.h>
+#include <util/type_name.h>
+
+#include "wire_header.h"
+#include "flush_policy.h"
+
+namespace ib_bench {
+
+/**
+ * The logical ranks of a single process, and the rings that connect them.
+ * Every rank has an inbox ring for data batches and one for control frames,
+ * which all ranks push to and the rank alone pops from.
+ * Create it before the ranks' backends, and destroy it after them.
+ */
+class loopback_world {
+public:
+    using msg_t = std::string;
+    using frame_t = wire_frame<msg_t>;
+
+    /// A flushed send buffer, and the counter of its sender's bytes in flight
+    struct batch {
+        std::vector<frame_t> frames;
+        std::atomic<size_t>* outstanding = nullptr;
+        size_t bytes = 0;
+    };
+
+    using inbox_t = mpsc_ring<batch>;
+
+    static constexpr size_t DEFAULT_INBOX_BATCHES = 1024;
+
+    /// @param inbox_batches Capacity of every inbox, in batches
+    explicit loopback_world(size_t ranks, size_t inbox_batches = DEFAULT_INBOX_BATCHES);
+
+    size_t size() const;
+    inbox_t& data_inbox(size_t rank);
+    inbox_t& ctrl_inbox(size_t rank);
+
+    /// Blocks until every rank called it
+    void barrier();
+
+    /**
+     * Compares a name between all ranks, and blocks until every rank
+     * called it. @return true if all ranks passed the same name.
+     */
+    bool all_equal(size_t rank, const std::string& name);
+
+private:
+    struct inboxes {
+        explicit inboxes(size_t capacity) : data(capacity), ctrl(capacity) { }
+        inbox_t data;
+        inbox_t ctrl;
+    };
+
+    /// The rings don't move, so every rank's pair is allocated on its own
+    std::vector<std::unique_ptr<inboxes>> m_inboxes;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    size_t m_arrived = 0;
+    size_t m_generation = 0;
+    std::vector<std::string> m_names;
+};
+
+/**
+ * A backend for the SRCommunicator class whose ranks are threads of a single
+ * process, connected by a loopback_world. A destination's buffered frames
+ * are pushed to its inbox as one batch, when the flush policy says so, and
+ * move to the receiver without a copy. With no network in between, what
+ * remains is the cost of the communicator's queues, serialization, sync and
+ * EOF, and any amount of ranks can be simulated on one machine.
+ *
+ * A batch whose destination's inbox is full waits at the sender, see
+ * may_send(). try_receive() yields the CPU when nothing arrived, since the
+ * logical ranks usually outnumber the cores.
+ */
+class LoopbackBackend {
+public:
+    using msg_t = loopback_world::msg_t;
+    using frame_t = loopback_world::frame_t;
+
+    /// flush - when to flush the send buffer of a remote host
+    LoopbackBackend(loopback_world& world, size_t rank, const flush_config& flush = {});
+    ~LoopbackBackend();
+    LoopbackBackend(const LoopbackBackend&) = delete;
+    LoopbackBackend& operator=(const LoopbackBackend&) = delete;
+
+public:
+    /**
+     * Puts the requested frame in a buffer of frames. Flushes the buffer
+     * when the flush policy says so. Can also flush manually using
+     * flush_send_buffers() and flush_expired_buffers().
+     */
+    void send(frame_t frame, size_t dest);
+
+    /// send() of a borrowed payload, copied into a frame of its own
+    void send_slice(const wire_slice& slice, size_t dest);
+
+    /// @return false, the send buffers belong to the run() thread
+    bool concurrent_send() const;
+
+    /**
+     * Sends a small control frame at once, on a lane of its own: it neither
+     * waits behind nor flushes the buffered data. Not ordered with send().
+     */
+    void send_control(const frame_t& frame, size_t dest);
+
+    /// Check if any batch still waits for room in an inbox
+    bool done_sending();
+
+    /**
+     * Backpressure: @return false while batches for dest wait for room in
+     * its inbox, or while the bytes pushed to it and not yet received reach
+     * flush_config::max_outstanding_bytes. Retries the waiting batches
+     * first, so calling it again makes progress.
+     */
+    bool may_send(size_t dest);
+    std::optional<std::vector<frame_t>> try_receive();
+    /// Send all data in buffers
+    void flush_send_buffers();
+    /// Send the data buffered for a single destination
+    void flush_send_buffer(size_t dest);
+    /// Send the buffers holding messages older than the latency target
+    void flush_expired_buffers();
+
+     /// Broadcasts to all hosts (including the sending host)
+    void broadcast(const frame_t& frame);
+    size_t rank() const;
+    size_t size() const;
+
+    /// A method for validating the front-end's type between different processes
+    template <class FrontEnd>
+    void validate_frontend_type() {
+        validate_frontend_type(type_name<FrontEnd>());
+    }
+
+private:
+    using batch_t = loopback_world::batch;
+    using inbox_t = loopback_world::inbox_t;
+
+    void validate_frontend_type(const std::string& type_name);
+    void flush_one_buffer(size_t buffer_num);
+
+     /// Pushes a batch to an inbox, behind the batches already waiting for it
+    void submit(inbox_t& inbox, std::deque<batch_t>& pending, batch_t&& batch);
+
+     /// Pushes waiting batches to an inbox, in order, while it has room
+    void drain(inbox_t& inbox, std::deque<batch_t>& pending);
+
+     /// drain() of every destination, on both lanes
+    void drain_all();
+
+     /// Pops up to RECV_BATCHES batches of an inbox into out
+    void receive(inbox_t& inbox, std::vector<frame_t>& out);
+
+    /// Batches taken from an inbox at once
+    static constexpr size_t RECV_BATCHES = 64;
+
+    loopback_world& m_world;
+    size_t m_rank;
+    /// Per destination, the frames to send on the next flush, and their bytes
+    std::vector<std::vector<frame_t>> m_send_buffers;
+    std::vector<size_t> m_buffered_bytes;
+    flush_policy m_flush;
+    /// Per destination, bytes pushed to its inbox and not yet received
+    std::vector<std::atomic<size_t>> m_outstanding_bytes;
+    size_t m_max_outstanding;
+    /// Per destination, batches waiting for room in its inboxes
+    std::vector<std::deque<batch_t>> m_pending_data;
+    std::vector<std::deque<batch_t>> m_pending_ctrl;
+    size_t m_pending_batches = 0;
+    /// try_pop_bulk() output
+    std::vector<batch_t> m_recv_batches;
+};
+
+} // namespace ib_bench
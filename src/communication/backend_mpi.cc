@@ -1,14 +1,39 @@
+#include <algorithm>
 #include <util/log.h>
+#include <util/validate.h>
 #include "backend_mpi.h"
 #include <boost/serialization/vector.hpp>
 
 namespace ib_bench {
 
-MPIBackend::MPIBackend(size_t flush_size) :
-    m_env(boost::mpi::threading::single),
-    m_recv_req(new_recv_request()),
+MPIBackend::MPIBackend(const flush_config& flush) :
+    m_env(flush.thread_multiple ? bmpi::threading::multiple : bmpi::threading::single),
+    m_outstanding_bytes(size()),
+    m_max_outstanding(flush.max_outstanding_bytes),
     m_send_buffers(size()),
-    m_flush_size(flush_size) {
+    m_flush(flush, size()),
+    m_raw(flush.raw_mpi),
+    m_fill_slabs(m_raw ? size() : 0),
+    m_free_slabs(m_raw ? size() : 0),
+    m_recv_slabs(m_raw ? std::make_shared<buffer_pool<recv_slab>>() : nullptr),
+    m_concurrent(flush.thread_multiple),
+    m_dest_mutexes(size())
+{
+    // MPI may have been initialized before, with a lower thread level
+    VALIDATE(!m_concurrent || bmpi::environment::thread_level() == bmpi::threading::multiple,
+             "MPI was not initialized with MPI_THREAD_MULTIPLE");
+    // Raw mode probes for its messages instead of posting receives
+    if (!m_raw) {
+        m_recv_req = new_recv_request();
+        m_ctrl_recv_req = new_ctrl_recv_request();
+        return;
+    }
+    for (size_t dest = 0; dest < size(); ++dest) {
+        for (size_t i = 0; i < flush.send_slabs; ++i) {
+            m_free_slabs[dest].push_back(new_slab(dest)->index);
+        }
+        m_fill_slabs[dest] = acquire_slab(dest);
+    }
 }
 
 MPIBackend::~MPIBackend() {
@@ -16,63 +41,273 @@ MPIBackend::~MPIBackend() {
     flush_send_buffers();
     BENCH_LOG_DEBUG("Communicator MPI backend waiting for all nodes to finish");
     m_world.barrier();
+    // MPI may still read from the slabs
+    MPI_Waitall(static_cast<int>(m_slab_reqs.size()), m_slab_reqs.data(), MPI_STATUSES_IGNORE);
 }
 
 bmpi::request MPIBackend::new_recv_request() {
-    return m_world.irecv(bmpi::any_source, 0, m_recv_buff);
+    return m_world.irecv(bmpi::any_source, DATA_TAG, m_recv_buff);
+}
+
+bmpi::request MPIBackend::new_ctrl_recv_request() {
+    return m_world.irecv(bmpi::any_source, CTRL_TAG, m_ctrl_recv_buff);
+}
+
+void MPIBackend::track_send(bmpi::request req, size_t dest, size_t bytes) {
+    if (!req.test()) {
+        on_send_start(dest, bytes);
+        m_send_reqs.push_back({std::move(req), dest, bytes});
+    }
+}
+
+void MPIBackend::on_send_start(size_t dest, size_t bytes) {
+    m_outstanding_bytes[dest].fetch_add(bytes, std::memory_order_relaxed);
+    ++m_outstanding_sends;
+}
+
+void MPIBackend::on_send_complete(size_t dest, size_t bytes) {
+    m_outstanding_bytes[dest].fetch_sub(bytes, std::memory_order_relaxed);
+    --m_outstanding_sends;
 }
 
 void MPIBackend::clear_send_requests() {
-    while (!m_send_reqs.empty() && m_send_reqs.front().test()) {
-        m_send_reqs.pop();
+    // A send stuck on a congested peer doesn't hold back the others
+    for (size_t i = 0; i < m_send_reqs.size();) {
+        auto& send = m_send_reqs[i];
+        if (!send.req.test()) {
+            ++i;
+            continue;
+        }
+        on_send_complete(send.dest, send.bytes);
+        send = std::move(m_send_reqs.back());
+        m_send_reqs.pop_back();
+    }
+    if (!m_raw || m_outstanding_sends == 0) {
+        return;
+    }
+    // Slabs may complete out of order, so test them all at once
+    int done = 0;
+    m_done_slabs.resize(m_slab_reqs.size());
+    MPI_Testsome(static_cast<int>(m_slab_reqs.size()), m_slab_reqs.data(), &done,
+                 m_done_slabs.data(), MPI_STATUSES_IGNORE);
+    // done is MPI_UNDEFINED only without active requests
+    for (int i = 0; i < done; ++i) {
+        auto& slab = m_slabs[m_done_slabs[i]];
+        on_send_complete(slab.dest, slab.buffer.size());
+        slab.buffer.clear();
+        m_free_slabs[slab.dest].push_back(slab.index);
+    }
+}
+
+auto MPIBackend::new_slab(size_t dest) -> send_slab* {
+    m_slabs.push_back({msg_t(), dest, m_slabs.size()});
+    m_slab_reqs.push_back(MPI_REQUEST_NULL);
+    return &m_slabs.back();
+}
+
+auto MPIBackend::acquire_slab(size_t dest) -> send_slab* {
+    auto& free = m_free_slabs[dest];
+    if (free.empty()) {
+        return new_slab(dest);
+    }
+    send_slab* slab = &m_slabs[free.back()];
+    free.pop_back();
+    return slab;
+}
+
+void MPIBackend::isend_slab(send_slab& slab, int tag) {
+    MPI_Isend(slab.buffer.data(), static_cast<int>(slab.buffer.size()), MPI_BYTE,
+              static_cast<int>(slab.dest), tag, MPI_Comm(m_world), &m_slab_reqs[slab.index]);
+    on_send_start(slab.dest, slab.buffer.size());
+}
+
+void MPIBackend::raw_receive(int tag, std::vector<recv_frame_t>& out) {
+    while (true) {
+        int flag = 0;
+        MPI_Message message;
+        MPI_Status status;
+        MPI_Improbe(MPI_ANY_SOURCE, tag, MPI_Comm(m_world), &flag, &message, &status);
+        if (!flag) {
+            return;
+        }
+        int count = 0;
+        MPI_Get_count(&status, MPI_BYTE, &count);
+        auto slab = acquire_recv_slab(m_recv_slabs, count);
+        MPI_Mrecv(slab->data(), count, MPI_BYTE, &message, MPI_STATUS_IGNORE);
+        unpack_frames(std::shared_ptr<const recv_slab>(std::move(slab)), count, out);
+    }
+}
+
+auto MPIBackend::lock(std::mutex& mutex) const -> lock_t {
+    return m_concurrent ? lock_t(mutex) : lock_t();
+}
+
+bool MPIBackend::concurrent_send() const {
+    return m_concurrent;
+}
+
+void MPIBackend::send(frame_t frame, size_t dest) {
+    if (m_raw) {
+        send_slice(frame.slice(), dest);
+        return;
+    }
+    size_t bytes = sizeof(frame.header) + frame.payload.size();
+    auto dest_lock = lock(m_dest_mutexes[dest]);
+    m_send_buffers[dest].push_back(std::move(frame));
+    on_buffered(dest, bytes);
+}
+
+void MPIBackend::send_slice(const wire_slice& slice, size_t dest) {
+    if (!m_raw) {
+        // Boost.Serialization needs the frame until the flush
+        send(frame_t{slice.header, msg_t(slice.data, slice.length)}, dest);
+        return;
     }
+    auto dest_lock = lock(m_dest_mutexes[dest]);
+    pack_frame(m_fill_slabs[dest]->buffer, slice);
+    on_buffered(dest, packed_size(slice.length));
 }
 
-void MPIBackend::send(const msg_t& msg, size_t dest) {
-    m_send_buffers[dest].push_back(msg);
-    if (m_send_buffers[dest].size() >= m_flush_size) {
+void MPIBackend::on_buffered(size_t dest, size_t bytes) {
+    bool full;
+    {
+        auto send_lock = lock(m_send_mutex);
+        full = m_flush.on_buffered(dest, bytes);
+    }
+    if (full) {
         flush_one_buffer(dest);
     }
 }
 
 void MPIBackend::flush_one_buffer(size_t buffer_num) {
     // If there's nothing to flush, save water!
-    if (m_send_buffers[buffer_num].size() == 0) {
+    if (m_raw ? m_fill_slabs[buffer_num]->buffer.empty() : m_send_buffers[buffer_num].empty()) {
         return;
     }
-    auto req = m_world.isend(buffer_num, 0, std::move(m_send_buffers[buffer_num]));
-    if (!req.test()) {
-        m_send_reqs.push(req);
+    auto send_lock = lock(m_send_mutex);
+    if (m_raw) {
+        send_slab* full = std::exchange(m_fill_slabs[buffer_num], acquire_slab(buffer_num));
+        isend_slab(*full, DATA_TAG);
+    } else {
+        auto& frames = m_send_buffers[buffer_num];
+        size_t bytes = 0;
+        for (const auto& frame : frames) {
+            bytes += sizeof(frame.header) + frame.payload.size();
+        }
+        // isend() serializes the frames at once, the vector keeps its capacity
+        track_send(m_world.isend(buffer_num, DATA_TAG, frames), buffer_num, bytes);
+        frames.clear();
     }
-    m_send_buffers[buffer_num].clear();
     clear_send_requests();
+    m_flush.on_flushed(buffer_num, m_outstanding_sends);
+}
+
+void MPIBackend::send_control(const frame_t& frame, size_t dest) {
+    auto send_lock = lock(m_send_mutex);
+    if (m_raw) {
+        send_slab* slab = acquire_slab(dest);
+        pack_frame(slab->buffer, frame);
+        isend_slab(*slab, CTRL_TAG);
+        return;
+    }
+    track_send(m_world.isend(dest, CTRL_TAG, frame), dest,
+               sizeof(frame.header) + frame.payload.size());
+}
+
+void MPIBackend::flush_send_buffer(size_t dest) {
+    {
+        auto dest_lock = lock(m_dest_mutexes[dest]);
+        flush_one_buffer(dest);
+    }
+    auto send_lock = lock(m_send_mutex);
+    m_flush.update_deadline();
 }
 
 void MPIBackend::flush_send_buffers() {
     for (size_t i = 0; i < size(); ++i) {
+        auto dest_lock = lock(m_dest_mutexes[i]);
         flush_one_buffer(i);
     }
+    auto send_lock = lock(m_send_mutex);
+    m_flush.update_deadline();
+}
+
+void MPIBackend::flush_expired_buffers() {
+    double now = flush_policy::now();
+    {
+        auto send_lock = lock(m_send_mutex);
+        if (!m_flush.any_expired(now)) {
+            return;
+        }
+        m_expired.clear();
+        for (size_t i = 0; i < size(); ++i) {
+            if (m_flush.expired(i, now)) {
+                m_expired.push_back(i);
+            }
+        }
+    }
+    // A sender may flush one meanwhile, which leaves it empty here
+    for (size_t dest : m_expired) {
+        auto dest_lock = lock(m_dest_mutexes[dest]);
+        flush_one_buffer(dest);
+    }
+    auto send_lock = lock(m_send_mutex);
+    m_flush.update_deadline();
 }
 
 bool MPIBackend::done_sending() {
+    auto send_lock = lock(m_send_mutex);
     // sending is done only when all send requests were cleared
     clear_send_requests();
-    return m_send_reqs.empty();
+    return m_outstanding_sends == 0;
 }
 
-auto MPIBackend::try_receive() -> std::optional<std::vector<msg_t>> {
-    auto got_recv = m_recv_req.test();
-    if (!got_recv) {
+bool MPIBackend::may_send(size_t dest) {
+    auto below_limit = [this, dest] {
+        return m_max_outstanding == 0 ||
+               m_outstanding_bytes[dest].load(std::memory_order_relaxed) < m_max_outstanding;
+    };
+    if (below_limit()) {
+        return true;
+    }
+    auto send_lock = lock(m_send_mutex);
+    clear_send_requests();
+    return below_limit();
+}
+
+auto MPIBackend::try_receive() -> std::optional<std::vector<recv_frame_t>> {
+    std::vector<recv_frame_t> rv;
+    if (m_raw) {
+        // Control frames first, they don't wait behind the data
+        raw_receive(CTRL_TAG, rv);
+        raw_receive(DATA_TAG, rv);
+        if (rv.empty()) {
+            return std::nullopt;
+        }
+        return rv;
+    }
+    // Control frames first, they don't wait behind the data
+    // The payloads are moved, not copied, into the received frames
+    while (m_ctrl_recv_req.test()) {
+        rv.push_back({m_ctrl_recv_buff.header, std::move(m_ctrl_recv_buff.payload)});
+        m_ctrl_recv_req = new_ctrl_recv_request();
+    }
+    if (m_recv_req.test()) {
+        for (auto& frame : m_recv_buff) {
+            rv.push_back({frame.header, std::move(frame.payload)});
+        }
+        m_recv_buff.clear();
+        m_recv_req = new_recv_request();
+    }
+    if (rv.empty()) {
         return std::nullopt;
     }
-    auto rv = std::move(m_recv_buff);
-    m_recv_req = new_recv_request();
     return rv;
 }
 
-void MPIBackend::broadcast(const msg_t& buffer) {
+void MPIBackend::broadcast(const frame_t& frame) {
     for (size_t i = 0; i < size(); ++i) {
-        send(buffer, i);
+        send(frame, i);
     }
 }
 
@@ -1,14 +1,21 @@
 #pragma once
 
+#include <atomic>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <optional>
-#include <queue>
 #include <string>
 #include <vector>
 #include <utility>
 
+#include <mpi.h>
 #include <boost/mpi.hpp>
 
+#include "wire_header.h"
+#include "slab_msg.h"
+#include "flush_policy.h"
+
 namespace ib_bench {
 
 namespace bmpi = boost::mpi;
@@ -17,32 +24,74 @@ namespace bmpi = boost::mpi;
  * An MPI backend for the SRCommunicator class. Uses a non-blocking send and
  * receive.
  *
+ * By default a destination's buffered frames are sent as a vector, with
+ * Boost.Serialization. With flush_config::raw_mpi the frames are packed
+ * back to back, {header, payload}, into one byte buffer which is sent with
+ * MPI_Isend, and received whole with MPI_Improbe and MPI_Mrecv. The buffers
+ * are slabs that every destination keeps and reuses once their sends complete
+ * (see flush_config::send_slabs), so once they grew to the batches' size,
+ * packing and sending allocate nothing. A received buffer lands in a pooled
+ * recv_slab, and its frames are read in place: their payloads point into
+ * the slab, which goes back to the pool once the last of them is released.
+ * Boost.Serialization still allocates its archives on every flush, and a
+ * payload on every receive.
+ *
+ * With flush_config::thread_multiple, MPI is initialized with
+ * MPI_THREAD_MULTIPLE and send(), flush_send_buffer(), flush_send_buffers()
+ * and done_sending() may be called from several threads at once (see
+ * concurrent_send()). try_receive() stays with a single thread.
  */
 class MPIBackend {
 public:
     using msg_t = std::string;
+    using frame_t = wire_frame<msg_t>;
+    using recv_msg_t = slab_msg;
+    using recv_frame_t = wire_frame<recv_msg_t>;
 
-    /// flush_size - max size of send buffer per remote host
-    MPIBackend(size_t flush_size = 1000);
+    /// flush - when to flush the send buffer of a remote host
+    MPIBackend(const flush_config& flush = {});
     ~MPIBackend();
     MPIBackend(MPIBackend&&) = default;
 
 public:
     /**
-     * Puts the requested message in a buffer of messages. Flushes the buffer
-     * when FLUSH_SIZE (static below) is reached. Can also flush manually using
-     * flush_send_buffers().
+     * Puts the requested frame in a buffer of frames. Flushes the buffer
+     * when the flush policy says so. Can also flush manually using
+     * flush_send_buffers() and flush_expired_buffers().
+     */
+    void send(frame_t frame, size_t dest);
+
+    /// send() of a borrowed payload: packed at once in raw mode, copied otherwise
+    void send_slice(const wire_slice& slice, size_t dest);
+
+    /// @return true if send() may be called from several threads at once
+    bool concurrent_send() const;
+
+    /**
+     * Sends a small control frame at once, on a lane of its own: it neither
+     * waits behind nor flushes the buffered data. Not ordered with send().
      */
-    void send(const msg_t& msg, size_t dest);
+    void send_control(const frame_t& frame, size_t dest);
 
     /// Check if any pending send requests remain
     bool done_sending();
-    std::optional<std::vector<msg_t>> try_receive();
+
+    /**
+     * Backpressure: @return false while the bytes sent to dest and not yet
+     * completed reach flush_config::max_outstanding_bytes. Reaps completed
+     * sends first, so calling it again makes progress.
+     */
+    bool may_send(size_t dest);
+    std::optional<std::vector<recv_frame_t>> try_receive();
     /// Send all data in buffers
     void flush_send_buffers();
+    /// Send the data buffered for a single destination
+    void flush_send_buffer(size_t dest);
+    /// Send the buffers holding messages older than the latency target
+    void flush_expired_buffers();
 
      /// Broadcasts to all hosts (including the sending host)
-    void broadcast(const msg_t& buffer);
+    void broadcast(const frame_t& frame);
     size_t rank() const;
     size_t size() const;
 
@@ -51,24 +100,105 @@ public:
     void validate_frontend_type();
 
 private:
+    /// Flushes a destination's buffer. The caller holds its lock.
     void flush_one_buffer(size_t buffer_num);
 
+    using lock_t = std::unique_lock<std::mutex>;
+
+     /// Locks the mutex with thread_multiple, does nothing otherwise
+    lock_t lock(std::mutex& mutex) const;
+
+    /// Raw mode: a send buffer of a destination. Never freed, its index in
+    /// m_slabs is its index in m_slab_reqs.
+    struct send_slab {
+        msg_t buffer;
+        size_t dest;
+        size_t index;
+    };
+
+     /// Sends a slab, which goes back to its destination once the send completes
+    void isend_slab(send_slab& slab, int tag);
+
+     /// Receives every raw buffer that arrived on the tag, into out
+    void raw_receive(int tag, std::vector<recv_frame_t>& out);
+
+     /// Adds a slab to dest's slabs, and returns it
+    send_slab* new_slab(size_t dest);
+
+     /// A free slab of dest, a new one if all are in flight
+    send_slab* acquire_slab(size_t dest);
+
+    /// MPI tags of the data and control lanes
+    static constexpr int DATA_TAG = 0;
+    static constexpr int CTRL_TAG = 1;
+
      /// Returns a new MPI recv request (use at ctor or after a recv is done)
     bmpi::request new_recv_request();
 
+     /// new_recv_request() of the control lane
+    bmpi::request new_ctrl_recv_request();
+
     /**
      * Goes over the send requests (=possibly pending messages) and checks
-     * if they were handled by the MPI. Clears the requests that were handled.
+     * if they were handled by the MPI. Clears the requests that were handled,
+     * in whatever order they completed, and counts them as completed.
      */
     void clear_send_requests();
 
+    /// A Boost.Serialization send in progress
+    struct pending_send {
+        bmpi::request req;
+        size_t dest;
+        size_t bytes;
+    };
+
+     /// Keeps a Boost.Serialization send until it completes
+    void track_send(bmpi::request req, size_t dest, size_t bytes);
+
+     /// Flushes dest's buffer if the flush policy says so. Under dest's lock.
+    void on_buffered(size_t dest, size_t bytes);
+
+     /// Counts a send of the given size to dest, until on_send_complete()
+    void on_send_start(size_t dest, size_t bytes);
+    void on_send_complete(size_t dest, size_t bytes);
+
     bmpi::environment m_env;
     bmpi::communicator m_world;
-    std::vector<msg_t> m_recv_buff;
+    std::vector<frame_t> m_recv_buff;
     bmpi::request m_recv_req;
-    std::queue<bmpi::request> m_send_reqs;
-    std::vector<std::vector<std::string>> m_send_buffers;
-    size_t m_flush_size;
+    frame_t m_ctrl_recv_buff;
+    bmpi::request m_ctrl_recv_req;
+    std::vector<pending_send> m_send_reqs;
+    /// Per destination, bytes of sends not yet completed, see may_send()
+    std::vector<std::atomic<size_t>> m_outstanding_bytes;
+    size_t m_outstanding_sends = 0;
+    size_t m_max_outstanding;
+    std::vector<std::vector<frame_t>> m_send_buffers;
+    flush_policy m_flush;
+    bool m_raw;
+    /// Raw mode: all slabs, a deque so that they stay put as it grows
+    std::deque<send_slab> m_slabs;
+    /// Raw mode: per slab, its send request, MPI_REQUEST_NULL while free
+    std::vector<MPI_Request> m_slab_reqs;
+    /// Raw mode: MPI_Testsome() output, the slabs whose sends completed
+    std::vector<int> m_done_slabs;
+    /// Raw mode: per destination, the slab that the frames are packed into
+    std::vector<send_slab*> m_fill_slabs;
+    /// Raw mode: per destination, its free slabs
+    std::vector<std::vector<size_t>> m_free_slabs;
+    /// Raw mode: the slabs that receives land in. Shared with the slabs,
+    /// which may be released after the backend is gone.
+    std::shared_ptr<buffer_pool<recv_slab>> m_recv_slabs;
+    bool m_concurrent;
+    /// Concurrent mode: per destination, guards its send buffer, and keeps
+    /// its flushes in order
+    std::vector<std::mutex> m_dest_mutexes;
+    /// Concurrent mode: guards the flush policy, the send requests and their
+    /// counters, and the slabs other than the fill slabs. Taken after a
+    /// destination's lock.
+    std::mutex m_send_mutex;
+    /// Destinations flush_expired_buffers() found expired
+    std::vector<size_t> m_expired;
 };
 
 } // namespace ib_bench
@@ -0,0 +1,304 @@
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <shmem.h>
+#include <boost/format.hpp>
+#include <util/log.h>
+#include <util/validate.h>
+#include "backend_shmem.h"
+
+namespace ib_bench {
+
+ShmemBackend::session::session() {
+    shmem_init();
+}
+
+ShmemBackend::session::~session() {
+    shmem_finalize();
+}
+
+ShmemBackend::ShmemBackend(const flush_config& flush) :
+    m_send_buffers(size()),
+    m_flush(flush, size()),
+    m_max_outstanding(flush.max_outstanding_bytes),
+    m_buffer_pool(buffer_pool<msg_t>::DEFAULT_MAX_BUFFERS, flush.shmem_ring_bytes)
+{
+    VALIDATE(flush.shmem_ring_bytes > sizeof(wire_header), "SHMEM rings are too small");
+    // cleared everywhere by the barrier of init_lane()
+    m_done_ranks = static_cast<position_t*>(shmem_calloc(1, sizeof(position_t)));
+    VALIDATE(m_done_ranks, "Symmetric heap too small for the done counter");
+    init_lane(m_data, flush.shmem_ring_bytes);
+    init_lane(m_ctrl, CTRL_RING_BYTES);
+}
+
+ShmemBackend::~ShmemBackend() {
+    // Sync all nodes before closing: every batch must be in its ring first,
+    // and the peers keep making room only while we keep consuming theirs
+    flush_send_buffers();
+    std::vector<frame_t> discarded;
+    auto consume = [&] {
+        receive(m_ctrl, discarded);
+        receive(m_data, discarded);
+        discarded.clear();
+    };
+    while (!done_sending()) {
+        consume();
+    }
+    // Our batches are all in place. Peers may still wait for room in our
+    // rings, so we consume until every rank reported the same.
+    for (size_t pe = 0; pe < size(); ++pe) {
+        shmem_ulonglong_atomic_inc(m_done_ranks, static_cast<int>(pe));
+    }
+    while (shmem_ulonglong_atomic_fetch(m_done_ranks, static_cast<int>(rank())) < size()) {
+        consume();
+    }
+    BENCH_LOG_DEBUG("Communicator SHMEM backend waiting for all nodes to finish");
+    shmem_barrier_all();
+    free_lane(m_ctrl);
+    free_lane(m_data);
+    shmem_free(m_done_ranks);
+}
+
+void ShmemBackend::init_lane(lane& l, size_t ring_bytes) {
+    l.ring_bytes = ring_bytes;
+    // shmem_calloc() is collective, and returns the same object on every rank
+    l.rings = static_cast<char*>(shmem_calloc(size(), ring_bytes));
+    l.tails = static_cast<position_t*>(shmem_calloc(size(), sizeof(position_t)));
+    l.heads = static_cast<position_t*>(shmem_calloc(size(), sizeof(position_t)));
+    VALIDATE(l.rings && l.tails && l.heads,
+             "Symmetric heap too small for " << size() << " rings of " << ring_bytes << " bytes");
+    l.written.assign(size(), 0);
+    l.consumed.assign(size(), 0);
+    l.pending.resize(size());
+    // Nobody writes a ring before every rank allocated and cleared it
+    shmem_barrier_all();
+}
+
+void ShmemBackend::free_lane(lane& l) {
+    shmem_free(l.heads);
+    shmem_free(l.tails);
+    shmem_free(l.rings);
+}
+
+void ShmemBackend::put(lane& l, const msg_t& batch, size_t dest) {
+    char* ring = l.rings + rank() * l.ring_bytes;
+    size_t offset = l.written[dest] % l.ring_bytes;
+    size_t first = std::min(batch.size(), l.ring_bytes - offset);
+    int pe = static_cast<int>(dest);
+    shmem_putmem_nbi(ring + offset, batch.data(), first, pe);
+    if (first < batch.size()) {
+        shmem_putmem_nbi(ring, batch.data() + first, batch.size() - first, pe);
+    }
+    l.written[dest] += batch.size();
+    // The tail may only move once the batch is in place
+    shmem_fence();
+    shmem_ulonglong_atomic_set(&l.tails[rank()], l.written[dest], pe);
+}
+
+void ShmemBackend::drain(lane& l, size_t dest) {
+    auto& queue = l.pending[dest];
+    while (!queue.empty()) {
+        auto& batch = queue.front();
+        position_t head = shmem_ulonglong_atomic_fetch(&l.heads[dest], static_cast<int>(rank()));
+        if (l.written[dest] + batch.size() - head > l.ring_bytes) {
+            return;
+        }
+        put(l, batch, dest);
+        // shmem_putmem_nbi() may still read from the batch
+        m_in_flight.push_back(std::move(batch));
+        queue.pop_front();
+        --l.pending_batches;
+    }
+}
+
+void ShmemBackend::drain_all(lane& l) {
+    if (l.pending_batches == 0) {
+        return;
+    }
+    for (size_t dest = 0; dest < size(); ++dest) {
+        drain(l, dest);
+    }
+}
+
+void ShmemBackend::submit(lane& l, msg_t&& batch, size_t dest) {
+    VALIDATE(batch.size() <= l.ring_bytes,
+        "SHMEM batch of " << batch.size() << " bytes exceeds a ring of " << l.ring_bytes);
+    l.pending[dest].push_back(std::move(batch));
+    ++l.pending_batches;
+    drain(l, dest);
+}
+
+void ShmemBackend::complete_puts() {
+    if (m_in_flight.empty()) {
+        return;
+    }
+    shmem_quiet();
+    for (auto& buffer : m_in_flight) {
+        m_buffer_pool.release(std::move(buffer));
+    }
+    m_in_flight.clear();
+}
+
+void ShmemBackend::receive(lane& l, std::vector<frame_t>& out) {
+    for (size_t source = 0; source < size(); ++source) {
+        position_t tail = shmem_ulonglong_atomic_fetch(&l.tails[source], static_cast<int>(rank()));
+        position_t& consumed = l.consumed[source];
+        if (tail == consumed) {
+            continue;
+        }
+        // Whole batches only: a tail is published after its batch
+        const char* ring = l.rings + source * l.ring_bytes;
+        size_t length = tail - consumed;
+        size_t offset = consumed % l.ring_bytes;
+        size_t first = std::min(length, l.ring_bytes - offset);
+        if (first == length) {
+            unpack_frames(ring + offset, length, out);
+        } else {
+            m_recv_buff.assign(ring + offset, first);
+            m_recv_buff.append(ring, length - first);
+            unpack_frames(m_recv_buff.data(), length, out);
+        }
+        consumed = tail;
+        // The frames were copied out, the source may overwrite their space
+        shmem_ulonglong_atomic_set(&l.heads[rank()], consumed, static_cast<int>(source));
+    }
+}
+
+void ShmemBackend::send(frame_t frame, size_t dest) {
+    send_slice(frame.slice(), dest);
+}
+
+void ShmemBackend::send_slice(const wire_slice& slice, size_t dest) {
+    size_t frame_bytes = packed_size(slice.length);
+    VALIDATE(frame_bytes <= m_data.ring_bytes,
+        "SHMEM frame of " << frame_bytes << " bytes exceeds a ring of " << m_data.ring_bytes);
+    // a batch must fit in the ring
+    if (m_send_buffers[dest].size() + frame_bytes > m_data.ring_bytes) {
+        flush_one_buffer(dest);
+    }
+    pack_frame(m_send_buffers[dest], slice);
+    if (m_flush.on_buffered(dest, frame_bytes)) {
+        flush_one_buffer(dest);
+    }
+}
+
+void ShmemBackend::flush_one_buffer(size_t buffer_num) {
+    // If there's nothing to flush, save water!
+    if (m_send_buffers[buffer_num].empty()) {
+        return;
+    }
+    // the next batch is likely about as large
+    msg_t batch = std::exchange(m_send_buffers[buffer_num], m_buffer_pool.acquire(
+        m_send_buffers[buffer_num].size()));
+    submit(m_data, std::move(batch), buffer_num);
+    m_flush.on_flushed(buffer_num, m_data.pending_batches);
+}
+
+void ShmemBackend::send_control(const frame_t& frame, size_t dest) {
+    msg_t batch = m_buffer_pool.acquire();
+    pack_frame(batch, frame);
+    submit(m_ctrl, std::move(batch), dest);
+}
+
+void ShmemBackend::flush_send_buffer(size_t dest) {
+    flush_one_buffer(dest);
+    m_flush.update_deadline();
+}
+
+void ShmemBackend::flush_send_buffers() {
+    for (size_t i = 0; i < size(); ++i) {
+        flush_one_buffer(i);
+    }
+    m_flush.update_deadline();
+}
+
+void ShmemBackend::flush_expired_buffers() {
+    double now = flush_policy::now();
+    if (!m_flush.any_expired(now)) {
+        return;
+    }
+    for (size_t i = 0; i < size(); ++i) {
+        if (m_flush.expired(i, now)) {
+            flush_one_buffer(i);
+        }
+    }
+    m_flush.update_deadline();
+}
+
+bool ShmemBackend::done_sending() {
+    // sending is done only when every batch was put, and the puts completed
+    drain_all(m_ctrl);
+    drain_all(m_data);
+    complete_puts();
+    return m_ctrl.pending_batches == 0 && m_data.pending_batches == 0;
+}
+
+bool ShmemBackend::may_send(size_t dest) {
+    drain(m_data, dest);
+    if (!m_data.pending[dest].empty()) {
+        return false;
+    }
+    if (m_max_outstanding == 0) {
+        return true;
+    }
+    position_t head = shmem_ulonglong_atomic_fetch(&m_data.heads[dest], static_cast<int>(rank()));
+    return m_data.written[dest] - head < m_max_outstanding;
+}
+
+std::optional<std::vector<ShmemBackend::frame_t>> ShmemBackend::try_receive() {
+    // Batches that waited for ring space go first, the peers may have made room
+    drain_all(m_ctrl);
+    drain_all(m_data);
+    complete_puts();
+    std::vector<frame_t> rv;
+    // Control frames first, they don't wait behind the data
+    receive(m_ctrl, rv);
+    receive(m_data, rv);
+    if (rv.empty()) {
+        return std::nullopt;
+    }
+    return rv;
+}
+
+void ShmemBackend::broadcast(const frame_t& frame) {
+    for (size_t i = 0; i < size(); ++i) {
+        send(frame, i);
+    }
+}
+
+void ShmemBackend::validate_frontend_type(const std::string& type_name) {
+    BENCH_LOG_DEBUG(
+        boost::format("[%d] Validating comm frontend type") % rank());
+    // Every rank puts the hash of its type name to rank 0, which compares them
+    auto hashes = static_cast<position_t*>(shmem_calloc(size(), sizeof(position_t)));
+    VALIDATE(hashes, "Symmetric heap too small to validate the frontend type");
+    // shmem_calloc() may clear the memory after its barrier
+    shmem_barrier_all();
+    position_t hash = std::hash<std::string>{}(type_name);
+    shmem_ulonglong_atomic_set(&hashes[rank()], hash, 0);
+    shmem_barrier_all();
+    bool match = std::all_of(hashes, hashes + size(), [&](position_t h) { return h == hash; });
+    shmem_free(hashes);
+    if (rank() == 0 && !match) {
+        throw std::runtime_error("Fatal error! Communicator types of "
+                                 "different nodes do not match!");
+    }
+    if (rank() == 0) {
+        BENCH_LOG_DEBUG("[0] Comm type validation successful");
+    }
+}
+
+bool ShmemBackend::concurrent_send() const {
+    return false;
+}
+
+size_t ShmemBackend::rank() const {
+    return static_cast<size_t>(shmem_my_pe());
+}
+
+size_t ShmemBackend::size() const {
+    return static_cast<size_t>(shmem_n_pes());
+}
+
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <deque>
+#include <optional>
+#include <string>
+#include <vector>
+#include <utility>
+#include <util/type_name.h>
+#include <util/buffer_pool.h>
+
+#include "wire_header.h"
+#include "flush_policy.h"
+
+namespace ib_bench {
+
+/**
+ * An OpenSHMEM backend for the SRCommunicator class. One-sided: every rank
+ * keeps a ring buffer in the symmetric heap for each peer, of
+ * flush_config::shmem_ring_bytes. A destination's buffered frames are packed
+ * back to back, {header, payload}, and the batch is written into the
+ * destination's ring with shmem_putmem_nbi(). Behind a shmem_fence(), an
+ * atomic set publishes the ring's new tail. The receiver polls its tails,
+ * copies the new batches out, and hands the space back to the sender with
+ * an atomic set of the ring's head there. A batch that does not fit waits at
+ * the sender until the receiver made room.
+ *
+ * Control frames have rings of their own, so they never wait behind data.
+ *
+ * Initializes and finalizes OpenSHMEM, so there is one backend per process.
+ */
+class ShmemBackend {
+public:
+    using msg_t = std::string;
+    using frame_t = wire_frame<msg_t>;
+
+    /// flush - when to flush the send buffer of a remote host
+    explicit ShmemBackend(const flush_config& flush = {});
+    ~ShmemBackend();
+    ShmemBackend(const ShmemBackend&) = delete;
+    ShmemBackend& operator=(const ShmemBackend&) = delete;
+
+public:
+    /**
+     * Puts the requested frame in a buffer of frames. Flushes the buffer
+     * when the flush policy says so. Can also flush manually using
+     * flush_send_buffers() and flush_expired_buffers().
+     */
+    void send(frame_t frame, size_t dest);
+
+    /// send() of a borrowed payload, which is packed at once
+    void send_slice(const wire_slice& slice, size_t dest);
+
+    /// @return false, the rings are written by the run() thread alone
+    bool concurrent_send() const;
+
+    /**
+     * Sends a small control frame at once, on a lane of its own: it neither
+     * waits behind nor flushes the buffered data. Not ordered with send().
+     */
+    void send_control(const frame_t& frame, size_t dest);
+
+    /// Check if any batch still waits for ring space, or any put is pending
+    bool done_sending();
+
+    /**
+     * Backpressure: @return false while batches for dest wait for ring
+     * space, or while the bytes in dest's ring that it did not consume yet
+     * reach flush_config::max_outstanding_bytes. Retries the waiting
+     * batches first, so calling it again makes progress.
+     */
+    bool may_send(size_t dest);
+    std::optional<std::vector<frame_t>> try_receive();
+    /// Send all data in buffers
+    void flush_send_buffers();
+    /// Send the data buffered for a single destination
+    void flush_send_buffer(size_t dest);
+    /// Send the buffers holding messages older than the latency target
+    void flush_expired_buffers();
+
+     /// Broadcasts to all hosts (including the sending host)
+    void broadcast(const frame_t& frame);
+    size_t rank() const;
+    size_t size() const;
+
+    /// A method for validating the front-end's type between different processes
+    template <class FrontEnd>
+    void validate_frontend_type() {
+        validate_frontend_type(type_name<FrontEnd>());
+    }
+
+private:
+    /// Ring positions count bytes since startup, the type of SHMEM's atomics
+    using position_t = unsigned long long;
+
+    /// A ring per peer and their positions, for the data or the control lane
+    struct lane {
+        size_t ring_bytes = 0;
+        /// Symmetric: size() rings, the one at source * ring_bytes is written by source
+        char* rings = nullptr;
+        /// Symmetric: per source, the position up to which it wrote its ring here
+        position_t* tails = nullptr;
+        /// Symmetric: per destination, the position up to which it consumed our ring there
+        position_t* heads = nullptr;
+        /// Per destination, the position up to which we wrote our ring there
+        std::vector<position_t> written;
+        /// Per source, the position up to which we consumed its ring here
+        std::vector<position_t> consumed;
+        /// Per destination, batches waiting for ring space
+        std::vector<std::deque<msg_t>> pending;
+        size_t pending_batches = 0;
+    };
+
+     /// Allocates a lane's symmetric memory. Collective.
+    void init_lane(lane& l, size_t ring_bytes);
+
+     /// Frees a lane's symmetric memory. Collective.
+    void free_lane(lane& l);
+
+     /// Queues a batch for dest, and writes as much of dest's queue as fits
+    void submit(lane& l, msg_t&& batch, size_t dest);
+
+     /// Writes dest's waiting batches, in order, while its ring has room
+    void drain(lane& l, size_t dest);
+
+     /// drain() of every destination
+    void drain_all(lane& l);
+
+     /// Writes a batch into dest's ring, wrapping around its end, and publishes it
+    void put(lane& l, const msg_t& batch, size_t dest);
+
+     /// Unpacks what every source wrote into the lane's rings since the last call
+    void receive(lane& l, std::vector<frame_t>& out);
+
+     /// Waits for the puts issued so far, and recycles their source buffers
+    void complete_puts();
+
+    void flush_one_buffer(size_t buffer_num);
+
+    void validate_frontend_type(const std::string& type_name);
+
+    /// Ring size of the control lane, which carries only small frames
+    static constexpr size_t CTRL_RING_BYTES = 64 * 1024;
+
+    /// Initializes OpenSHMEM first, and finalizes it last
+    struct session {
+        session();
+        ~session();
+    };
+
+    session m_session;
+    /// Symmetric: ranks done sending, counted by each of them on every rank
+    position_t* m_done_ranks = nullptr;
+    lane m_data;
+    lane m_ctrl;
+    /// Per destination, the batch of frames to send on the next flush
+    std::vector<msg_t> m_send_buffers;
+    flush_policy m_flush;
+    size_t m_max_outstanding;
+    /// Source buffers of puts that shmem_quiet() did not complete yet
+    std::vector<msg_t> m_in_flight;
+    /// Buffers of completed puts, to pack the next batches into
+    buffer_pool<msg_t> m_buffer_pool;
+    /// A batch that wrapped around the end of its ring, made contiguous
+    msg_t m_recv_buff;
+};
+
+} // namespace ib_bench
@@ -1,26 +1,56 @@
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <boost/format.hpp>
+#include <util/accurate_timer.h>
 #include <util/log.h>
+#include <util/validate.h>
 #include "backend_ucx.h"
 #include <boost/serialization/vector.hpp>
 
 namespace ib_bench {
 
-UCXBackend::UCXBackend(ucp::communicator& comm, size_t flush_size) :
+UCXBackend::UCXBackend(ucp::communicator& comm, const flush_config& flush) :
     m_world(comm),
-    m_recv_req(new_recv_request()),
+    m_recv_ring(flush.recv_slots),
+    m_slot_bytes(flush.recv_slot_bytes),
+    m_ctrl_recv_req(new_ctrl_recv_request()),
+    m_outstanding_bytes(size()),
+    m_max_outstanding(flush.max_outstanding_bytes),
     m_send_buffers(size()),
-    m_flush_size(flush_size)
+    m_flush(flush, size())
 {
+    m_slot_buffers.reserve(m_recv_ring.size());
     std::generate(
         begin(m_send_buffers), 
         end(m_send_buffers), 
-        []{ return std::make_shared<std::vector<msg_t>>(); }
+        []{ return std::make_shared<msg_t>(); }
     ); 
+    VALIDATE(size() <= ucx_tag::MAX_RANKS, "Too many ranks for the UCX tag layout");
+    VALIDATE(!m_recv_ring.empty(), "UCX backend needs at least one receive slot");
+    VALIDATE(m_slot_bytes > sizeof(wire_header), "UCX receive slots are too small");
+    for (auto& slot : m_recv_ring) {
+        slot.buffer = msg_t(m_slot_bytes, 0);
+        post_recv(slot);
+    }
+    m_direct_threshold = flush.direct_bytes ? flush.direct_bytes : probe_direct_threshold();
+    BENCH_LOG_DEBUG(boost::format("[%d] UCX backend sends messages of %d bytes and up directly")
+                    % rank() % m_direct_threshold);
 }
 
 UCXBackend::~UCXBackend() {
-    // Sync all nodes before closing
+    // Sync all nodes before closing. The send callbacks point to this
+    // backend, so every send completes first.
     flush_send_buffers();
-    m_world.get_worker().cancel_request(m_recv_req);
+    while (!done_sending()) {
+    }
+    for (auto& slot : m_recv_ring) {
+        m_world.get_worker().cancel_request(slot.req);
+    }
+    if (m_large_pending) {
+        m_world.get_worker().cancel_request(m_large_req);
+    }
+    m_world.get_worker().cancel_request(m_ctrl_recv_req);
     BENCH_LOG_DEBUG("Communicator UCX backend waiting for all nodes to finish");
     m_world.barrier();
 }
@@ -46,85 +76,379 @@ void UCXBackend::validate_frontend_type(const std::string& type_name) {
 */
 }
 
-ucp::request UCXBackend::new_recv_request() {
-    m_arrived_size = m_world.get_worker().get_pending_size(m_world.rank());
-    if (m_arrived_size) {
-        m_recv_buff.clear();
-        m_recv_buff.push_back(msg_t(m_arrived_size, 0));
-        return m_world.async_receive(m_recv_buff[0], m_world.rank());
+void UCXBackend::post_recv(recv_slot& slot) {
+    // A message that arrived already may complete the receive at once,
+    // without calling back: its length is the probed one
+    slot.length = m_world.get_worker().get_pending_size(data_tag(rank()));
+    slot.req = m_world.async_receive(
+        slot.buffer,
+        data_tag(rank()),
+        [&slot](ucs_status_t status, size_t length) {
+            slot.status = status;
+            slot.length = length;
+        }
+    );
+}
+
+ucp::request UCXBackend::new_ctrl_recv_request() {
+    size_t arrived_size = m_world.get_worker().get_pending_size(ctrl_tag(m_world.rank()));
+    if (arrived_size) {
+        m_ctrl_recv_buff = msg_t(arrived_size, 0);
+        return m_world.async_receive(m_ctrl_recv_buff, ctrl_tag(m_world.rank()));
     }
     return ucp::request();
 }
 
-void UCXBackend::clear_send_requests() {
+void UCXBackend::track_send(size_t dest, std::shared_ptr<msg_t> msg, uint64_t tag) {
+    size_t index;
+    if (m_free_sends.empty()) {
+        index = m_sends.size();
+        m_sends.emplace_back();
+    } else {
+        index = m_free_sends.back();
+        m_free_sends.pop_back();
+    }
+    auto& send = m_sends[index];
+    // The entry holds the buffer until the send completes
+    send.msg = std::move(msg);
+    send.dest = dest;
+    send.bytes = send.msg->size();
+    send.active = true;
+    uint64_t generation = ++send.generation;
+    m_outstanding_bytes[dest] += send.bytes;
+    ++m_outstanding_sends;
+    auto req = m_world.async_send(
+        dest,
+        *send.msg,
+        tag,
+        [this, index, generation](ucs_status_t status, size_t size) {
+            complete_send(index, generation);
+        }
+    );
+    // UCP calls back only for the sends it did not complete at once
+    if (!req.in_progress()) {
+        complete_send(index, generation);
+    }
+}
+
+void UCXBackend::complete_send(size_t index, uint64_t generation) {
+    auto& send = m_sends[index];
+    // Counted once, whether the callback, track_send() or both see the completion
+    if (!send.active || send.generation != generation) {
+        return;
+    }
+    send.active = false;
+    m_outstanding_bytes[send.dest] -= send.bytes;
+    --m_outstanding_sends;
+    auto msg = std::move(send.msg);
+    m_free_sends.push_back(index);
+    if (msg->capacity() < m_slot_bytes) {
+        msg->clear();
+        m_free_buffers.push_back(std::move(msg));
+    } else {
+        recycle(std::move(*msg));
+    }
+}
+
+auto UCXBackend::acquire_buffer() -> std::shared_ptr<msg_t> {
+    if (m_free_buffers.empty()) {
+        return std::make_shared<msg_t>();
+    }
+    auto rv = std::move(m_free_buffers.back());
+    m_free_buffers.pop_back();
+    return rv;
+}
+
+UCXBackend::msg_t UCXBackend::gather(const frame_t& frame) {
+    msg_t msg;
+    msg.reserve(frame.payload.size() + sizeof(wire_header));
+    gather_into(msg, frame.slice());
+    return msg;
+}
+
+void UCXBackend::gather_into(msg_t& batch, const wire_slice& frame) {
+    auto [header, payload] = frame.iov();
+    batch.append(static_cast<const char*>(payload.base), payload.length);
+    batch.append(static_cast<const char*>(header.base), header.length);
+}
+
+UCXBackend::msg_t UCXBackend::gather(frame_t&& frame) {
+    msg_t msg = std::move(frame.payload);
+    msg.append(reinterpret_cast<const char*>(&frame.header), sizeof(wire_header));
+    return msg;
+}
+
+bool UCXBackend::scatter(msg_t& msg, size_t length, size_t reuse_bytes, std::vector<frame_t>& out) {
+    size_t first = out.size();
+    size_t end = length;
+    bool reused = false;
+    while (end > 0) {
+        VALIDATE(end >= sizeof(wire_header), "Truncated UCX message");
+        frame_t frame;
+        size_t payload_end = end - sizeof(wire_header);
+        std::memcpy(&frame.header, msg.data() + payload_end, sizeof(wire_header));
+        VALIDATE(frame.header.length <= payload_end, "Corrupted UCX message");
+        size_t payload_begin = payload_end - frame.header.length;
+        if (payload_begin == 0 && frame.header.length >= reuse_bytes) {
+            // the first frame keeps the received buffer
+            msg.resize(payload_end);
+            frame.payload = std::move(msg);
+            reused = true;
+        } else {
+            frame.payload.assign(msg.data() + payload_begin, frame.header.length);
+        }
+        out.push_back(std::move(frame));
+        end = payload_begin;
+    }
+    std::reverse(out.begin() + first, out.end());
+    return reused;
+}
+
+auto UCXBackend::acquire_slot_buffer() -> msg_t {
+    if (m_slot_buffers.empty()) {
+        return msg_t(m_slot_bytes, 0);
+    }
+    msg_t buffer = std::move(m_slot_buffers.back());
+    m_slot_buffers.pop_back();
+    // The old content is received over, so a buffer kept at its size is
+    // only shrunk, or grown (and filled) by what it lacks
+    buffer.resize(m_slot_bytes);
+    return buffer;
+}
+
+void UCXBackend::recycle(msg_t&& buffer) {
+    // buffers large enough for a slot replace those handed over by scatter()
+    if (buffer.capacity() >= m_slot_bytes && buffer.capacity() <= 2 * m_slot_bytes &&
+        m_slot_buffers.size() < m_recv_ring.size()) {
+        m_slot_buffers.push_back(std::move(buffer));
+    }
+}
+
+size_t UCXBackend::probe_direct_threshold() {
+    constexpr size_t PROBE_SENDS = 64;
+    constexpr size_t PROBE_COPIES = 8;
+    constexpr size_t PROBE_BYTES = 1 << 20;
+    constexpr size_t MIN_THRESHOLD = 4 * 1024;
+    constexpr size_t MAX_THRESHOLD = 1 << 20;
+
+    // Cost of one more send: a small message to self, on a tag of its own
+    msg_t out(sizeof(wire_header), 0);
+    msg_t in(sizeof(wire_header), 0);
+    accurate_timer timer;
+    for (size_t i = 0; i < PROBE_SENDS; ++i) {
+        auto recv_req = m_world.async_receive(in, probe_tag());
+        auto send_req = m_world.async_send(rank(), out, probe_tag());
+        while (recv_req.in_progress() || send_req.in_progress()) {
+            m_world.get_context().poll();
+        }
+    }
+    double send_sec = timer.elapsed() / PROBE_SENDS;
+
+    // Cost of a byte copied into a send buffer
+    msg_t src(PROBE_BYTES, 1);
+    msg_t dst;
+    size_t checksum = 0;
+    timer.reset();
+    for (size_t i = 0; i < PROBE_COPIES; ++i) {
+        dst.assign(src);
+        checksum += dst[i];
+    }
+    double byte_sec = timer.elapsed() / (PROBE_COPIES * PROBE_BYTES);
+
+    VALIDATE(checksum == PROBE_COPIES, "Direct threshold probe failed");
+    if (byte_sec <= 0) {
+        return MAX_THRESHOLD;
+    }
+    return std::clamp(static_cast<size_t>(send_sec / byte_sec), MIN_THRESHOLD, MAX_THRESHOLD);
+}
+
+void UCXBackend::send_direct(frame_t&& frame, size_t dest) {
+    send_direct(std::make_shared<msg_t>(gather(std::move(frame))), dest);
+}
+
+void UCXBackend::send_direct(std::shared_ptr<msg_t> msg_ptr, size_t dest) {
+    if (msg_ptr->size() > m_slot_bytes) {
+        send_large(std::move(msg_ptr), dest);
+        return;
+    }
+    track_send(dest, std::move(msg_ptr), data_tag(dest));
+    m_world.get_context().poll();
+}
+
+void UCXBackend::send_large(std::shared_ptr<msg_t> msg_ptr, size_t dest) {
+    VALIDATE(msg_ptr->size() <= std::numeric_limits<uint32_t>::max(),
+        "UCX message of " << msg_ptr->size() << " bytes is too large");
+    frame_t announcement{{}, {}};
+    announcement.header.type = LARGE_FOLLOWS;
+    announcement.header.source = static_cast<uint32_t>(rank());
+    announcement.header.sequence = static_cast<uint32_t>(msg_ptr->size());
+    auto announcement_ptr = acquire_buffer();
+    gather_into(*announcement_ptr, announcement.slice());
+    track_send(dest, std::move(announcement_ptr), data_tag(dest));
+    track_send(dest, std::move(msg_ptr), large_tag(rank(), dest));
     m_world.get_context().poll();
-    while (!m_send_reqs.empty() && !m_send_reqs.front().in_progress()) {
-        m_send_reqs.pop();
+}
+
+void UCXBackend::send(frame_t frame, size_t dest) {
+    if (frame.payload.size() >= m_direct_threshold ||
+        frame.payload.size() + sizeof(wire_header) > m_slot_bytes) {
+        // whatever is buffered for dest goes first, to keep the order
+        flush_one_buffer(dest);
+        send_direct(std::move(frame), dest);
+        return;
     }
+    send_slice(frame.slice(), dest);
+    recycle(std::move(frame.payload));
 }
 
-void UCXBackend::send(const msg_t& msg, size_t dest) {
-    m_send_buffers[dest]->push_back(msg);
-    if (m_send_buffers[dest]->size() >= m_flush_size) {
+void UCXBackend::send_slice(const wire_slice& slice, size_t dest) {
+    size_t frame_bytes = slice.length + sizeof(wire_header);
+    if (slice.length >= m_direct_threshold || frame_bytes > m_slot_bytes) {
+        flush_one_buffer(dest);
+        // the slice is gone once we return, the send needs a copy of its own
+        auto msg_ptr = acquire_buffer();
+        msg_ptr->reserve(frame_bytes);
+        gather_into(*msg_ptr, slice);
+        send_direct(std::move(msg_ptr), dest);
+        return;
+    }
+    // a batch must fit in a receive slot
+    if (m_send_buffers[dest]->size() + frame_bytes > m_slot_bytes) {
+        flush_one_buffer(dest);
+    }
+    gather_into(*m_send_buffers[dest], slice);
+    if (m_flush.on_buffered(dest, frame_bytes)) {
         flush_one_buffer(dest);
     }
 }
 
 void UCXBackend::flush_one_buffer(size_t buffer_num) {
     // If there's nothing to flush, save water!
-    auto buffs_ptr = m_send_buffers[buffer_num];
-    if (buffs_ptr->size() == 0) {
+    auto batch_ptr = m_send_buffers[buffer_num];
+    if (batch_ptr->empty()) {
         return;
     }
-    for (const auto& buf : *buffs_ptr) {
-        auto req = m_world.async_send(
-            buffer_num, 
-            buf, 
-            buffer_num, 
-            [buffs_ptr](ucs_status_t status, size_t size) { }
-        );
-        m_world.get_context().poll();
-        if (req.in_progress()) {
-            m_send_reqs.push(std::move(req));
-        }
-    }
-    m_send_buffers[buffer_num] = std::make_shared<std::vector<msg_t>>();
-    clear_send_requests();
+    m_send_buffers[buffer_num] = acquire_buffer();
+    // the next batch is likely about as large
+    m_send_buffers[buffer_num]->reserve(batch_ptr->size());
+    // The whole batch in one send
+    track_send(buffer_num, std::move(batch_ptr), data_tag(buffer_num));
+    m_world.get_context().poll();
+    m_flush.on_flushed(buffer_num, m_outstanding_sends);
+}
+
+void UCXBackend::send_control(const frame_t& frame, size_t dest) {
+    auto msg_ptr = acquire_buffer();
+    gather_into(*msg_ptr, frame.slice());
+    track_send(dest, std::move(msg_ptr), ctrl_tag(dest));
+    m_world.get_context().poll();
+}
+
+void UCXBackend::flush_send_buffer(size_t dest) {
+    flush_one_buffer(dest);
+    m_flush.update_deadline();
 }
 
 void UCXBackend::flush_send_buffers() {
     for (size_t i = 0; i < size(); ++i) {
         flush_one_buffer(i);
     }
+    m_flush.update_deadline();
+}
+
+void UCXBackend::flush_expired_buffers() {
+    double now = flush_policy::now();
+    if (!m_flush.any_expired(now)) {
+        return;
+    }
+    for (size_t i = 0; i < size(); ++i) {
+        if (m_flush.expired(i, now)) {
+            flush_one_buffer(i);
+        }
+    }
+    m_flush.update_deadline();
 }
 
 bool UCXBackend::done_sending() {
-    // sending is done only when all send requests were cleared
-    clear_send_requests();
-    return m_send_reqs.empty();
+    // sending is done only when all sends completed
+    m_world.get_context().poll();
+    return m_outstanding_sends == 0;
 }
 
-std::optional<std::vector<UCXBackend::msg_t>> UCXBackend::try_receive() {
+bool UCXBackend::may_send(size_t dest) {
+    if (m_max_outstanding == 0 || m_outstanding_bytes[dest] < m_max_outstanding) {
+        return true;
+    }
     m_world.get_context().poll();
-    if (!m_recv_req.is_ptr()) {
-        m_recv_req = new_recv_request();
-        return std::nullopt;
+    return m_outstanding_bytes[dest] < m_max_outstanding;
+}
+
+std::optional<std::vector<UCXBackend::frame_t>> UCXBackend::try_receive() {
+    m_world.get_context().poll();
+    std::vector<frame_t> rv;
+    // Control frames first, they don't wait behind the data
+    if (!m_ctrl_recv_req.is_ptr()) {
+        m_ctrl_recv_req = new_ctrl_recv_request();
+    } else if (!m_ctrl_recv_req.in_progress()) {
+        scatter(m_ctrl_recv_buff, m_ctrl_recv_buff.size(), 0, rv);
+        m_ctrl_recv_req = new_ctrl_recv_request();
     }
-    if (m_recv_req.in_progress()) {
+    // Data in the order the ring was posted, stopping at the first slot
+    // still waiting, or at an announced message that did not arrive yet
+    while (true) {
+        if (m_large_pending) {
+            if (m_large_req.in_progress()) {
+                break;
+            }
+            scatter(m_large_buff, m_large_buff.size(), 0, rv);
+            m_large_pending = false;
+        }
+        auto& slot = m_recv_ring[m_ring_head];
+        if (slot.req.in_progress()) {
+            break;
+        }
+        ucp::check(slot.status);
+        // an empty batch is never sent
+        VALIDATE(slot.length > 0, "UCX receive completed without its length");
+        // A frame filling most of the slot takes its buffer rather than a copy,
+        // and the slot is posted again with a recycled one
+        if (scatter(slot.buffer, slot.length, m_slot_bytes / 2, rv)) {
+            slot.buffer = acquire_slot_buffer();
+        }
+        post_recv(slot);
+        m_ring_head = (m_ring_head + 1) % m_recv_ring.size();
+        if (!rv.empty() && rv.back().header.type == LARGE_FOLLOWS) {
+            size_t source = rv.back().header.source;
+            m_large_buff = msg_t(rv.back().header.sequence, 0);
+            rv.pop_back();
+            m_large_req = m_world.async_receive(m_large_buff, large_tag(source, rank()));
+            m_large_pending = true;
+        }
+    }
+    if (rv.empty()) {
         return std::nullopt;
     }
-    auto rv = std::move(m_recv_buff);
-    m_arrived_size = 0;
-    m_recv_req = new_recv_request();
     return rv;
 }
 
-void UCXBackend::broadcast(const msg_t& buffer) {
+void UCXBackend::broadcast(const frame_t& frame) {
+    size_t frame_bytes = frame.payload.size() + sizeof(wire_header);
+    VALIDATE(frame_bytes <= m_slot_bytes, "Broadcast frame exceeds a UCX receive slot");
     for (size_t i = 0; i < size(); ++i) {
-        send(buffer, i);
+        if (m_send_buffers[i]->size() + frame_bytes > m_slot_bytes) {
+            flush_one_buffer(i);
+        }
+        gather_into(*m_send_buffers[i], frame.slice());
+        if (m_flush.on_buffered(i, frame.payload.size() + sizeof(wire_header))) {
+            flush_one_buffer(i);
+        }
     }
 }
 
+bool UCXBackend::concurrent_send() const {
+    return false;
+}
+
 size_t UCXBackend::rank() const {
     return m_world.rank();
 }
@@ -2,7 +2,6 @@
 
 #include <memory>
 #include <optional>
-#include <queue>
 #include <string>
 #include <vector>
 #include <utility>
@@ -12,41 +11,88 @@
 #include <request.h>
 #include <communicator.h>
 
+#include "wire_header.h"
+#include "flush_policy.h"
+#include "ucx_tag.h"
+
 namespace ib_bench {
 
 /**
  * A UCX backend for the SRCommunicator class. Uses a non-blocking send and
  * receive.
  *
+ * Picks a protocol per message: small messages are packed into a single
+ * contiguous buffer per destination, which is flushed by the flush policy as
+ * one UCX send, messages of flush_config::direct_bytes
+ * and up are sent at once from the payload's own memory, which UCX sends by
+ * rendezvous once it is large enough.
+ *
+ * Data arrives into a ring of flush_config::recv_slots receives that stay
+ * posted, each of recv_slot_bytes, and is delivered in the order the ring
+ * was posted. A message too large for a slot is preceded by an announcement
+ * on the data tag, upon which the receiver posts a receive for it alone.
  */
 class UCXBackend {
 public:
     using msg_t = std::string;
+    using frame_t = wire_frame<msg_t>;
 
-    /// flush_size - max size of send buffer per remote host
-    UCXBackend(ucp::communicator& comm, size_t flush_size = 1000);
+    /// flush - when to flush the send buffer of a remote host
+    UCXBackend(ucp::communicator& comm, const flush_config& flush = {});
     ~UCXBackend();
     UCXBackend(UCXBackend&&) = default;
 
 public:
     /**
-     * Puts the requested message in a buffer of messages. Flushes the buffer
-     * when FLUSH_SIZE (static below) is reached. Can also flush manually using
-     * flush_send_buffers().
+     * Puts the requested frame in a buffer of messages. Flushes the buffer
+     * when the flush policy says so. Can also flush manually using
+     * flush_send_buffers() and flush_expired_buffers().
+     * Large frames flush the buffer and are sent directly, see send_direct().
+     */
+    void send(frame_t frame, size_t dest);
+
+    /**
+     * send() of a borrowed payload. Gathered into the send buffer at once,
+     * or into a copy of its own if it is sent directly.
+     */
+    void send_slice(const wire_slice& slice, size_t dest);
+
+    /// @return false, the worker is driven by the run() thread alone
+    bool concurrent_send() const;
+
+    /**
+     * Sends a small control frame at once, on a lane of its own: it neither
+     * waits behind nor flushes the buffered data. Not ordered with send().
      */
-    void send(const msg_t& msg, size_t dest);
+    void send_control(const frame_t& frame, size_t dest);
 
     /// Check if any pending send requests remain
     bool done_sending();
-    std::optional<std::vector<msg_t>> try_receive();
+
+    /**
+     * Backpressure: @return false while the bytes sent to dest and not yet
+     * completed reach flush_config::max_outstanding_bytes. Progresses the
+     * worker first, so calling it again makes progress.
+     */
+    bool may_send(size_t dest);
+    std::optional<std::vector<frame_t>> try_receive();
     /// Send all data in buffers
     void flush_send_buffers();
+    /// Send the data buffered for a single destination
+    void flush_send_buffer(size_t dest);
+    /// Send the buffers holding messages older than the latency target
+    void flush_expired_buffers();
 
      /// Broadcasts to all hosts (including the sending host)
-    void broadcast(const msg_t& buffer);
+    void broadcast(const frame_t& frame);
     size_t rank() const;
     size_t size() const;
 
+    /// Payload size from which send() skips the buffers
+    size_t direct_threshold() const {
+        return m_direct_threshold;
+    }
+
     /// A method for validating the front-end's type between different processes
     template <class FrontEnd>
     void validate_frontend_type() {
@@ -57,23 +103,149 @@ private:
     void validate_frontend_type(const std::string& type_name);
     void flush_one_buffer(size_t buffer_num);
 
-     /// Returns a new UCX recv request (use at ctor or after a recv is done)
-    ucp::request new_recv_request();
+    /// Sends a frame at once from its own payload, kept alive until it's sent
+    void send_direct(frame_t&& frame, size_t dest);
+
+     /// Sends a gathered message at once, see gather()
+    void send_direct(std::shared_ptr<msg_t> msg_ptr, size_t dest);
+
+    /**
+     * Times a direct send against copying into a send buffer, and returns the
+     * payload size from which the saved copy pays for the extra send.
+     * Local to this rank, no other rank takes part: a heuristic, see
+     * flush_config::direct_bytes.
+     */
+    size_t probe_direct_threshold();
+
+    /**
+     * Gathers a frame into a single tagged message: {payload, header}.
+     * The header goes last, so the receiver strips it without moving the payload.
+     * A batch is several gathered frames back to back, and every header
+     * holds its payload's length, so a batch is split from its end.
+     */
+    static msg_t gather(const frame_t& frame);
+
+     /// gather() that appends the header to the payload in place
+    static msg_t gather(frame_t&& frame);
+
+     /// Appends a gathered frame to a batch
+    static void gather_into(msg_t& batch, const wire_slice& frame);
 
     /**
-     * Goes over the send requests (=possibly pending messages) and checks
-     * if they were handled by the UCX. Clears the requests that were handled.
+     * The inverse of gather(): splits the first length bytes of msg, one or
+     * more gathered frames, and appends them to out in the order they were
+     * gathered. The first frame takes msg's buffer if its payload has at
+     * least reuse_bytes, the rest are copied out of it.
+     * @return true if msg's buffer was taken
      */
-    void clear_send_requests();
+    static bool scatter(msg_t& msg, size_t length, size_t reuse_bytes, std::vector<frame_t>& out);
+
+     /// A receive slot's buffer, recycled if possible
+    msg_t acquire_slot_buffer();
+
+     /// Keeps a spent buffer, content and size included, for
+     /// acquire_slot_buffer(), if it is large enough
+    void recycle(msg_t&& buffer);
+
+    /// A receive of the ring, and the buffer it receives into
+    struct recv_slot {
+        msg_t buffer;
+        ucp::request req;
+        size_t length = 0;
+        ucs_status_t status{};
+    };
+
+     /// (Re)posts the receive of a ring slot
+    void post_recv(recv_slot& slot);
+
+    /// Frame type, out of the communicator's range, announcing a large message
+    static constexpr uint8_t LARGE_FOLLOWS = 0xff;
+
+     /// Sends a message larger than a ring slot, behind its announcement
+    void send_large(std::shared_ptr<msg_t> msg_ptr, size_t dest);
+
+    /// Tag of the data lane towards the given rank, see ucx_tag.h
+    static uint64_t data_tag(size_t dest) {
+        return ucx_tag::make(ucx_tag::msg_class::data, ucx_tag::ANY_SOURCE, dest);
+    }
+
+    /// Tag of the control lane towards the given rank
+    static uint64_t ctrl_tag(size_t dest) {
+        return ucx_tag::make(ucx_tag::msg_class::control, ucx_tag::ANY_SOURCE, dest);
+    }
+
+    /// Tag of probe_direct_threshold()'s sends to self
+    uint64_t probe_tag() const {
+        return ucx_tag::make(ucx_tag::msg_class::probe, rank(), rank());
+    }
+
+    /// Tag of large messages from source to dest, see send_large()
+    static uint64_t large_tag(size_t source, size_t dest) {
+        return ucx_tag::make(ucx_tag::msg_class::large, source, dest);
+    }
+
+     /// new_recv_request() of the control lane
+    ucp::request new_ctrl_recv_request();
+
+    /**
+     * Sends msg to dest on the tag, and keeps it alive in an entry of
+     * m_sends until the send completes. The completion callback updates the
+     * outstanding counters, in whatever order the sends complete, and
+     * recycles the buffer. A send that completes at once is completed by
+     * track_send() itself.
+     */
+    void track_send(size_t dest, std::shared_ptr<msg_t> msg, uint64_t tag);
+
+    /**
+     * Counts the completion of a send of track_send(), and recycles its
+     * buffer. Only the first call for the entry's generation counts, so
+     * the callback and track_send() may both report the same completion.
+     */
+    void complete_send(size_t index, uint64_t generation);
+
+    /// A send of track_send() in flight, or a free entry
+    struct tracked_send {
+        std::shared_ptr<msg_t> msg;
+        size_t dest = 0;
+        size_t bytes = 0;
+        /// Counts the entry's sends, a stale completion does not match
+        uint64_t generation = 0;
+        bool active = false;
+    };
+
+     /// An empty send buffer, recycled if possible
+    std::shared_ptr<msg_t> acquire_buffer();
 
     ucp::communicator& m_world;
-    size_t m_arrived_size;
-    std::vector<msg_t> m_recv_buff;
-    ucp::request m_recv_req;
-    std::queue<ucp::request> m_send_reqs;
-    std::vector<std::shared_ptr<std::vector<msg_t>>> m_send_buffers;
-    size_t m_flush_size;
+    /// Posted once, never resized: the receive callbacks point into it
+    std::vector<recv_slot> m_recv_ring;
+    /// The slot whose data is delivered next
+    size_t m_ring_head = 0;
+    size_t m_slot_bytes;
+    /// An announced large message, delivered before the ring goes on
+    msg_t m_large_buff;
+    ucp::request m_large_req;
+    bool m_large_pending = false;
+    msg_t m_ctrl_recv_buff;
+    ucp::request m_ctrl_recv_req;
+    /// Per destination, bytes of sends not yet completed, see may_send()
+    std::vector<size_t> m_outstanding_bytes;
+    size_t m_outstanding_sends = 0;
+    /// Sends in flight, and the indices of the free entries
+    std::vector<tracked_send> m_sends;
+    std::vector<size_t> m_free_sends;
+    size_t m_max_outstanding;
+    /// Buffers of completed sends, up to a receive slot large
+    std::vector<std::shared_ptr<msg_t>> m_free_buffers;
+    /// Per destination, the batch of frames to send on the next flush
+    std::vector<std::shared_ptr<msg_t>> m_send_buffers;
+    flush_policy m_flush;
+    size_t m_direct_threshold;
     size_t m_pending_send = 0;
+    /// Buffers of a receive slot's capacity and up, for the slots whose
+    /// buffer went to a frame. Not cleared, so refilling a slot need not
+    /// fill the buffer again.
+    std::vector<msg_t> m_slot_buffers;
 };
 
 } // namespace ib_bench
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <util/squeue.h>
+#include <util/mpsc_ring.h>
+
+namespace ib_bench {
+
+/**
+ * Compile-time policies of BasicSRCommunicator. A policy is a struct
+ * providing the following members:
+ *
+ * send_queue_t<T> - the queue type that sender threads push outgoing
+ *                   messages into, and that the run() thread drains. Required
+ *                   to have push(), try_pop(), try_pop_bulk(), empty(),
+ *                   eof() and mark_eof() interfaces (see squeue).
+ *
+ * wait_spin_count - how many times wait_recv() and wait_synchronize() poll
+ *                   before the waiting thread goes to sleep.
+ *
+ * tree_eof        - how a channel closes once every node marked it EOF.
+ *                   true: EOFs are aggregated up a binomial tree and the
+ *                   close comes back down, O(N) messages overall. false:
+ *                   every node broadcasts its EOF, O(N^2) messages.
+ *
+ * send_quantum    - bytes a channel of weight 1 may send per poll of the send
+ *                   queues, while other channels have messages waiting too
+ *                   (see BasicSRCommunicator::set_channel_weights()).
+ *
+ * fragment_size   - data messages larger than this many bytes are sent in
+ *                   fragments of at most this size, so other channels'
+ *                   messages go out between them. The receiver reassembles
+ *                   them before the message is handed to the consumer.
+ *                   A channel fragments one message at a time, in queue
+ *                   order: its messages to other destinations wait for the
+ *                   last fragment, they are not interleaved with it. Only
+ *                   if its destination is congested (see Backend::may_send())
+ *                   is the message set aside, and the others go on.
+ *
+ * New policies are best derived from default_comm_policy, overriding only
+ * the members they change.
+ */
+struct default_comm_policy {
+    /// A mutex-based queue, unbounded
+    template <class T>
+    using send_queue_t = squeue<T>;
+
+    static constexpr size_t wait_spin_count = 256;
+
+    static constexpr bool tree_eof = true;
+
+    static constexpr size_t send_quantum = 64 * 1024;
+
+    static constexpr size_t fragment_size = 64 * 1024;
+};
+
+/**
+ * Sender threads push into bounded lock-free rings instead of a locked queue.
+ * Preferable with several sender threads and small messages, where the send
+ * queue lock dominates.
+ */
+struct lockfree_comm_policy : default_comm_policy {
+    template <class T>
+    using send_queue_t = mpsc_ring<T>;
+};
+
+}
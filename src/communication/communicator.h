@@ -1,20 +1,53 @@
 #pragma once
 
 #include <array>
+#include <atomic>
+#include <deque>
+#include <limits>
 #include <condition_variable>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <mutex>
+#include <thread>
 #include <tuple>
+#include <type_traits>
+#include <vector>
 #include <util/squeue.h>
 #include <util/list.h>
+#include <util/buffer_pool.h>
+#include <util/event_count.h>
 #include <util/accurate_timer.h>
 #include <numeric>
 
+#include "comm_policy.h"
+#include "wire_header.h"
+#include "msg_view.h"
+#include "util/serialization.h"
 #include "util/log.h"
 #include <iostream>
 
 namespace ib_bench {
 
+/// A synchronize() in progress, see BasicSRCommunicator::begin_synchronize()
+struct sync_handle {
+    size_t channel;
+    /// The channel's synchronize() count, including this one
+    uint64_t epoch;
+};
+
+/// Backend::recv_msg_t if the backend hands out received payloads of a
+/// type of their own, Backend::msg_t otherwise
+template <class Backend, class = void>
+struct backend_recv_msg {
+    using type = typename Backend::msg_t;
+};
+
+template <class Backend>
+struct backend_recv_msg<Backend, std::void_t<typename Backend::recv_msg_t>> {
+    using type = typename Backend::recv_msg_t;
+};
+
 /***
  *  2-Way Communicator. The Communicator consists of 2-way channels
  *  (each given as a separate template argument), and provides a compile-time type-safe interface
@@ -32,26 +65,51 @@ namespace ib_bench {
  *     considered closed.
  *  4) Once all channels are closed, run() will exit.
  *
- * @tparam Backend - Backend communication class. Required to have a non-blocking send(msg),
- * and try_receive(), broadcast(msg), done_sending(), size(), rank() interfaces.
+ *  Alternatively, a receive handler may be set on a channel before run() starts (see
+ *  set_receive_handler()). The run() thread then hands the channel's messages to the handler
+ *  as they arrive, and nothing is ever queued for receive<N>().
+ *
+ * @tparam Backend - Backend communication class. Required to have a non-blocking send(frame, dest),
+ * send_control(frame, dest), and try_receive(), broadcast(frame), flush_send_buffer(dest),
+ * flush_send_buffers(), flush_expired_buffers(), done_sending(), size(), rank() interfaces.
+ * Frames are wire_frame<msg_t> (see wire_header.h), and try_receive() returns a batch of them.
+ * A backend may receive payloads of another type, recv_msg_t, such as views into the buffer they
+ * arrived in (see slab_msg.h). It needs data(), size(), begin() and end(), a conversion to
+ * std::string_view, construction from a msg_t&&, and a recycle() overload (see buffer_pool.h).
+ * send_slice(slice, dest) is send() of a payload borrowed for the call only (see wire_slice),
+ * which is how large messages go out in fragments without copying each one out first.
+ * send_control() sends at once on a lane of its own, that is not ordered with send().
+ * concurrent_send() tells whether send() may be called from several threads at once. If so,
+ * send<N>() hands data messages to the backend from the caller's thread, and the send queues
+ * only carry sync and EOF markers: channel weights and fragmentation don't apply to them.
+ * may_send(dest) applies backpressure: while it returns false, data for dest is held back,
+ * set aside by the run() thread while the channel goes on with other destinations, or by
+ * the sender thread with concurrent_send().
  * done_sending() is an interface for checking if the backend has finished sending all messages.
  * size() returns the total amount of nodes, and rank() returns the current node's index.
+ * @tparam Policy - Compile-time policies, see comm_policy.h
  * @tparam ChannelTypes - Channel types
  */
-template <class Backend, class ...ChannelTypes>
-class SRCommunicator {
+template <class Backend, class Policy, class ...ChannelTypes>
+class BasicSRCommunicator {
 public:
-    SRCommunicator(SRCommunicator<Backend, ChannelTypes...>&&) = delete;
+    BasicSRCommunicator(BasicSRCommunicator&&) = delete;
     static constexpr size_t CHANS_AMOUNT = sizeof...(ChannelTypes);
-    static_assert(CHANS_AMOUNT <= 256, "Maximum allowed channels is 256");
+    static_assert(CHANS_AMOUNT <= std::numeric_limits<uint16_t>::max() + 1,
+                  "Maximum allowed channels is 65536");
     using raw_msg_t = typename Backend::msg_t;
+    using frame_t = wire_frame<raw_msg_t>;
+    using recv_msg_t = typename backend_recv_msg<Backend>::type;
+    using recv_frame_t = wire_frame<recv_msg_t>;
     using chan_types_list = typename meta::list::of<ChannelTypes...>;
+    template <size_t CHAN_NUM>
+    using view_t = msg_view<meta::list::get<chan_types_list, CHAN_NUM>, recv_msg_t, raw_msg_t>;
 
-    explicit SRCommunicator(std::unique_ptr<Backend>&& backend_ptr);
+    explicit BasicSRCommunicator(std::unique_ptr<Backend>&& backend_ptr);
 
     template <class ...BackendArgs>
-    explicit SRCommunicator(BackendArgs&& ...args);
-    ~SRCommunicator();
+    explicit BasicSRCommunicator(BackendArgs&& ...args);
+    ~BasicSRCommunicator();
 
     template <size_t CHAN_NUM>
     void send(const meta::list::get<chan_types_list, CHAN_NUM>& obj,
@@ -68,6 +126,65 @@ public:
     template <size_t CHAN_NUM>
     auto try_receive();
 
+    /**
+     * Blocking receive into an existing object, reusing its storage.
+     * Returns false if the channel is closed.
+     */
+    template <size_t CHAN_NUM>
+    bool receive_into(meta::list::get<chan_types_list, CHAN_NUM>& out);
+
+    /// Non-blocking receive_into(). Returns false if nothing to receive
+    template <size_t CHAN_NUM>
+    bool try_receive_into(meta::list::get<chan_types_list, CHAN_NUM>& out);
+
+    /**
+     * Non-blocking receive of up to max_count messages into the caller's
+     * objects out[0], out[1], ... The receive queue is locked once per call.
+     * @return The number of received messages
+     */
+    template <size_t CHAN_NUM>
+    size_t try_receive_bulk(meta::list::get<chan_types_list, CHAN_NUM>* out,
+                            size_t max_count);
+
+    /**
+     * Blocking receive of a view into the received payload, see msg_view.
+     * Returns std::optional<view_t<CHAN_NUM>>, empty if the channel is closed.
+     * Nothing is copied or deserialized until the view is read.
+     */
+    template <size_t CHAN_NUM>
+    auto receive_view();
+
+    /// Non-blocking receive_view(). Returns nullopt if nothing to receive
+    template <size_t CHAN_NUM>
+    auto try_receive_view();
+
+    /**
+     * Non-blocking receive of up to max_count views, moved into out.
+     * @return The number of received views
+     */
+    template <size_t CHAN_NUM, class OutputIt>
+    size_t try_receive_view_bulk(OutputIt out, size_t max_count);
+
+    /**
+     * Makes run() call handler(view_t<CHAN_NUM>&&) for every message that
+     * arrives on the channel, instead of queueing it for the receive calls.
+     * Sync messages are handled by run() too. The handler runs in the run()
+     * thread, so it should be light and must not block on the communicator.
+     * Call before run() is started.
+     */
+    template <size_t CHAN_NUM, class Handler>
+    void set_receive_handler(Handler&& handler);
+
+    /**
+     * Sets how run() shares the send path between channels. The send queues
+     * are drained by deficit round robin: every poll, a channel with queued
+     * messages earns weight * Policy::send_quantum bytes of credit, and sends
+     * messages while its credit covers them. A flooded channel thus can't
+     * starve the others. Weights default to 1, and must be positive.
+     * Call before run() is started.
+     */
+    void set_channel_weights(const std::array<size_t, CHANS_AMOUNT>& weights);
+
     bool is_closed(size_t ch_Num) const;
 
     /**
@@ -75,15 +192,43 @@ public:
      * 1) synchronize() was called.
      * 2) messages that other nodes had sent before calling synchronize()
      *    were handled.
+     *
+     * Each node first fences the destinations it sent data to since its
+     * last synchronize(): a sync marker follows the data, and the receiver
+     * acks it once its consumer has received everything before it. With all
+     * fences acked, the nodes run a dissemination barrier, ceil(log2(size()))
+     * rounds of one message each. So a synchronize() costs O(N log N)
+     * messages plus one fence per communicating pair, instead of O(N^2).
      * WARNING: CHAN_NUM's receive handler must be single threaded to use this!
      */
     template <size_t CHAN_NUM>
     void synchronize();
 
+    /**
+     * Split-phase synchronize(): starts the sync and returns at once, so the
+     * caller may keep sending on other channels (or to other destinations)
+     * while it completes. Complete it with wait_synchronize() or poll it
+     * with test_synchronize(). Several syncs of a channel may be in flight,
+     * they complete in order.
+     */
+    template <size_t CHAN_NUM>
+    sync_handle begin_synchronize();
+
+     /// @return true if the sync of the handle completed
+    bool test_synchronize(const sync_handle& handle) const;
+
+     /// Blocks until the sync of the handle completes
+    void wait_synchronize(const sync_handle& handle);
+
     /**
      * Marks the channel as EOF, meaning that this node guarantees that after
      * it empties the channel's send queue it will send no more data. Calling
      * send() on an EOF channel throws.
+     *
+     * With Policy::tree_eof, the node fences the destinations it sent data
+     * to since its last fence, and they ack the fence on arrival. Once acked,
+     * and once its subtree in a binomial tree is done, the node reports to
+     * its parent. The root then closes the channel down the tree.
      */
     void mark_eof(size_t ch_num);
 
@@ -101,9 +246,16 @@ public:
      */
     void run();
 
-     /// Wait until the Communicator receives any message (cond. wait)
+    /**
+     * Wait until any channel has a message to receive, or all channels are
+     * EOF. Spins for Policy::wait_spin_count polls, then sleeps until woken
+     * by an arrival. May return spuriously.
+     */
     void wait_recv();
 
+     /// wait_recv() for a single channel
+    void wait_recv(size_t ch_num);
+
     /**
      * Block wait until ALL communication is over, then extract the backend
      * and return it.
@@ -113,23 +265,89 @@ private:
     enum class MsgType : uint8_t {
         data = 0,
         eof = 1,
-        sync = 2,
-        ack = 3
+        sync = 2,    ///< fence, queued in order with the data before it
+        ack = 3,     ///< the fence was received by the consumer
+        barrier = 4, ///< a dissemination barrier round
+        eof_fence = 5, ///< tree EOF: follows the data before mark_eof()
+        eof_ack = 6,   ///< tree EOF: the fence arrived
+        eof_done = 7,  ///< tree EOF: the sender's subtree is done sending
+        eof_close = 8, ///< tree EOF: the channel is closed
+        fragment = 9   ///< a part of a data message, see Policy::fragment_size
     };
 
+    /**
+     * Per channel, whether its type is copied to and from the wire as is
+     * (see util::is_raw_serializable), skipping the serialization streams.
+     */
+    static constexpr std::array<bool, CHANS_AMOUNT> RAW_CHANNELS = {
+        util::is_raw_serializable_v<ChannelTypes>...
+    };
+
+    /**
+     * Serializes obj into a wire payload taken from the buffer pool.
+     * memcpy for raw channels, cereal into the buffer otherwise. Either way
+     * the payload has room for a backend to append the header in place.
+     */
+    template <size_t CHAN_NUM>
+    raw_msg_t encode(const meta::list::get<chan_types_list, CHAN_NUM>& obj);
+
+     /// The inverse of encode(). Returns the payload to the buffer pool.
+    template <size_t CHAN_NUM>
+    auto decode(recv_msg_t&& msg);
+
+     /// decode() into an existing object
+    template <size_t CHAN_NUM>
+    void decode_into(recv_msg_t&& msg, meta::list::get<chan_types_list, CHAN_NUM>& out);
+
     struct SendMsgProp {
         raw_msg_t data;
         MsgType msg_type;
         size_t dest;
+        /// Data messages sent in fragments: the bytes sent so far
+        size_t sent = 0;
     };
 
     struct RecvMsgProp {
-        raw_msg_t data;
+        recv_msg_t data;
         MsgType type;
+        size_t source = 0;
 
-        RecvMsgProp(raw_msg_t data) :
+        RecvMsgProp(recv_msg_t data) :
             data(std::move(data)), type(MsgType::data) { }
-        RecvMsgProp(MsgType type) : type(type) { }
+        RecvMsgProp(MsgType type, size_t source) : type(type), source(source) { }
+    };
+
+    /// Control messages that consumer threads ask the run() thread to send
+    struct CtrlMsgProp {
+        MsgType msg_type;
+        size_t chan;
+        size_t dest;
+    };
+
+    /// Per channel progress of synchronize(), touched by the run() thread only
+    struct SyncState {
+        bool active = false;
+        /// Syncs requested while one was active, started once it completes
+        size_t deferred = 0;
+        /// Completed syncs. The epoch in progress is carried in the header's
+        /// sequence field.
+        uint32_t epoch = 0;
+        size_t pending_acks = 0;
+        size_t round = 0;
+        /// Whether the current round's message was sent
+        bool round_sent = false;
+        /// Barrier messages that arrived, per epoch parity and round. A node
+        /// is never more than an epoch ahead of another.
+        std::array<std::vector<size_t>, 2> arrivals;
+    };
+
+    /// Per channel progress of the tree EOF, touched by the run() thread only
+    struct EofState {
+        /// This node's mark_eof() went through the send queue
+        bool local = false;
+        size_t pending_acks = 0;
+        size_t children_done = 0;
+        bool reported = false;
     };
 
     /**
@@ -139,49 +357,208 @@ private:
      */
     void increment_eof_counter(size_t chan_num);
 
-    void increment_sync_counter(size_t chan_num);
+    /// Tree EOF: fences this node's destinations
+    void begin_eof(size_t chan_num);
+
+    /// Tree EOF: reports to the parent (or closes, at the root) when ready
+    void try_report_eof(size_t chan_num);
+
+    /// Tree EOF: closes the channel here and at the children
+    void close_channel(size_t chan_num);
+
+    /// Parent in a binomial tree rooted at 0
+    size_t eof_parent() const;
+
+    /// Calls f(child) for every child in the binomial tree
+    template <class F>
+    void for_each_eof_child(F&& f) const;
+
+    /// Asks the run() thread to ack a sync marker the consumer received
+    void handle_sync_message(const RecvMsgProp& msg, size_t chan_num);
+
+    /// Starts a synchronize() of the channel: fences its destinations
+    void begin_sync(size_t chan_num);
+
+    void handle_ack(size_t chan_num);
+
+    void handle_barrier(size_t chan_num, uint32_t epoch, size_t round);
+
+    /// Sends barrier rounds whose predecessors arrived, completes the sync
+    void advance_barrier(size_t chan_num);
+
+    /// A frame of the channel around payload, its sequence left to the caller
+    frame_t make_frame(MsgType type, size_t chan_num, raw_msg_t&& payload) const;
+
+    /**
+     * Counts a data message sent to dest. Call once the backend took it, so
+     * a fence that sees the count follows the message.
+     */
+    void count_sent(size_t chan_num, size_t dest);
+
+    /// A control message with an empty payload
+    frame_t control_frame(MsgType type, size_t chan_num,
+                          uint32_t sequence = 0, uint8_t flags = 0) const;
+
+    /// Sends a control message on the backend's control lane
+    void send_control(MsgType type, size_t chan_num, size_t dest,
+                      uint32_t sequence = 0, uint8_t flags = 0);
+
+    /**
+     * Sends a fence behind the channel's data to dest, and flushes it. Fences
+     * must stay ordered with the data, so they don't use the control lane.
+     */
+    void send_fence(MsgType type, size_t chan_num, size_t dest);
+
+     /// Send the control messages queued by consumer threads
+    void poll_and_handle_ctrl_queue();
 
-    void send_ack(size_t chan_num);
+    /**
+     * Pops the channel's next data message, handling any sync
+     * messages on the way. Blocks, throws squeue_eof once the channel closes.
+     */
+    RecvMsgProp pop_data_msg(size_t chan_num);
 
-    void increment_ack_counter(size_t chan_num);
+     /// Non-blocking pop_data_msg()
+    boost::optional<RecvMsgProp> try_pop_data_msg(size_t chan_num);
 
-    void handle_sync_ack_messages(RecvMsgProp msg, size_t chan_num);
+    /**
+     * Pops up to max_count messages under a single queue lock, handles sync
+     * messages among them, and calls on_data(recv_msg_t&&) for each
+     * data message, in order.
+     * @return The number of data messages
+     */
+    template <class OnData>
+    size_t try_pop_data_bulk(size_t chan_num, size_t max_count, OnData&& on_data);
 
-     /// Poll all the send queues once and send any given messages
+     /// Poll all the send queues once and send the messages their credit allows
     void poll_and_handle_send_queues();
 
+     /// Sends a message popped from the channel's send queue
+    void handle_send_msg(size_t chan_id, SendMsgProp&& msg);
+
+    /**
+     * Sends a data message, in fragments if it is large, as far as the
+     * channel's credit covers.
+     * @return true once the whole message was sent
+     */
+    bool send_data(size_t chan_id, SendMsgProp& msg, size_t& deficit);
+
+    /**
+     * Sends the messages set aside for the destinations that are no longer
+     * congested, in order, as far as the channel's credit covers.
+     * @return false if the credit ran out
+     */
+    bool send_blocked(size_t chan_id, size_t& deficit);
+
+    /**
+     * Sends the next fragments of a large data message, as many as the
+     * channel's credit covers.
+     * @return true once the whole message was sent
+     */
+    bool send_fragments(size_t chan_id, SendMsgProp& msg, size_t& deficit);
+
+    /**
+     * Appends a fragment to the message being reassembled from its source.
+     * @return The message, once its last fragment arrived
+     */
+    std::optional<raw_msg_t> reassemble(size_t chan_id, recv_frame_t&& frame);
+
      /// Poll the backend for any received messages and handle them
     void poll_and_handle_recv_backend();
 
      /// @return true if all channels are closed
     bool all_done() const;
 
+     /// @return true if a receive call on the channel would not block
+    bool recv_ready(size_t ch_num) const;
+
+     /// Wakes the channel's waiters, and those waiting for any channel
+    void notify_recv(size_t ch_num);
+
      /// @return true if channel has been marked EOF and send queue empty
     bool send_done();
 
-    using send_queue_t = squeue<SendMsgProp>;
+    using send_queue_t = typename Policy::template send_queue_t<SendMsgProp>;
     using recv_queue_t = squeue<RecvMsgProp>;
+    using recv_handler_t = std::function<void(recv_msg_t&&)>;
 
     std::unique_ptr<Backend> m_backend;
     std::array<send_queue_t, CHANS_AMOUNT> m_send_queues;
     std::array<recv_queue_t, CHANS_AMOUNT> m_recv_queues;
+    /// Per channel receive handler, empty for queued channels
+    std::array<recv_handler_t, CHANS_AMOUNT> m_recv_handlers;
     std::array<size_t, CHANS_AMOUNT> m_global_eof_counters;
-    std::array<size_t, CHANS_AMOUNT> m_sync_counters;
-    std::array<size_t, CHANS_AMOUNT> m_ack_counters;
-
-    mutable std::condition_variable m_recv_cond;
-    mutable std::condition_variable m_sync_cond;
+    /// Per channel, per destination count of the data messages sent, for the fences.
+    /// Sender threads count their own sends, see Backend::concurrent_send().
+    std::array<std::unique_ptr<std::atomic<uint32_t>[]>, CHANS_AMOUNT> m_send_sequences;
+    /// m_send_sequences as of the last fence sent to each destination
+    std::array<std::vector<uint32_t>, CHANS_AMOUNT> m_fenced_sequences;
+    std::array<SyncState, CHANS_AMOUNT> m_sync_states;
+    std::array<EofState, CHANS_AMOUNT> m_eof_states;
+    size_t m_eof_children = 0;
+    /// Amount of dissemination barrier rounds
+    size_t m_barrier_rounds = 0;
+    squeue<CtrlMsgProp> m_ctrl_queue;
+    std::vector<CtrlMsgProp> m_ctrl_batch;
+
+    /// Per channel arrival events, and one for arrivals on any channel
+    std::array<event_count, CHANS_AMOUNT> m_recv_events;
+    event_count m_any_recv_event;
+    /// Channels whose queues were pushed during the current backend poll
+    std::vector<size_t> m_recv_touched;
+    std::array<bool, CHANS_AMOUNT> m_recv_touched_flags{};
+    /// Per channel, syncs requested by begin_synchronize() and completed
+    std::array<std::atomic<uint64_t>, CHANS_AMOUNT> m_sync_requested{};
+    std::array<std::atomic<uint64_t>, CHANS_AMOUNT> m_sync_completed{};
+    std::array<event_count, CHANS_AMOUNT> m_sync_events;
     mutable std::condition_variable m_extraction_cond;
-    mutable std::mutex m_sync_mutex;
 
-    bool m_synchronized = false;
     bool m_send_done = false;
     bool m_all_done = false;
+    /// Sender threads send data messages through the backend themselves
+    bool m_direct_send = false;
+
+     /// Max messages popped from a send queue at once
+    static constexpr size_t SEND_BATCH_SIZE = 256;
+    /// Per channel, messages popped from the send queue but not yet sent
+    std::array<std::deque<SendMsgProp>, CHANS_AMOUNT> m_send_pending;
+    /// Per channel, bytes of credit earned every poll, and left unspent
+    std::array<size_t, CHANS_AMOUNT> m_send_quanta;
+    std::array<size_t, CHANS_AMOUNT> m_send_deficits{};
+    /// Per channel and destination, data messages set aside while the
+    /// destination is congested (see Backend::may_send()), in order
+    std::array<std::vector<std::deque<SendMsgProp>>, CHANS_AMOUNT> m_send_blocked;
+    /// Per channel, the messages in m_send_blocked
+    std::array<size_t, CHANS_AMOUNT> m_send_blocked_count{};
+    /// Messages a channel sets aside at most. Beyond that the channel waits
+    /// as a whole, so a bounded send queue still holds back its senders.
+    static constexpr size_t MAX_SEND_BLOCKED = 4 * SEND_BATCH_SIZE;
+    /// Per channel and source, the fragmented message being reassembled.
+    /// A channel sends one message to a destination in fragments at a time,
+    /// so from each source they arrive one message after another.
+    std::array<std::vector<raw_msg_t>, CHANS_AMOUNT> m_reassembly;
+    /// Per channel, the size of the last serialized payload, to reserve the next one
+    std::array<std::atomic<size_t>, CHANS_AMOUNT> m_encoded_bytes{};
+    /// Recycles payload buffers between received and sent messages
+    buffer_pool<raw_msg_t> m_buffer_pool;
+};
 
-    accurate_timer m_flush_timer;
-    static constexpr double FLUSH_INTERVAL_SEC = 1e-2;
+/// How a consumer takes the messages of a channel
+enum class receive_mode {
+    queue,   ///< receive calls from a consumer thread
+    handler  ///< a receive handler called by the run() thread
 };
 
+/// A communicator with the default policies
+template <class Backend, class ...ChannelTypes>
+using SRCommunicator =
+    BasicSRCommunicator<Backend, default_comm_policy, ChannelTypes...>;
+
+/// A communicator whose send queues are lock-free rings
+template <class Backend, class ...ChannelTypes>
+using LockFreeSRCommunicator =
+    BasicSRCommunicator<Backend, lockfree_comm_policy, ChannelTypes...>;
+
 }
 
 #include "communicator.inl"
@@ -1,4 +1,5 @@
 #include <chrono>
+#include <cstring>
 #include <iomanip>
 #include <boost/format.hpp>
 
@@ -13,42 +14,67 @@
 
 namespace ib_bench {
 
-template <class Backend, class ...ChannelTypes>
-SRCommunicator<Backend, ChannelTypes...>::SRCommunicator(
+template <class Backend, class Policy, class ...ChannelTypes>
+BasicSRCommunicator<Backend, Policy, ChannelTypes...>::BasicSRCommunicator(
     std::unique_ptr<Backend>&& backend_ptr) :
     m_backend(std::move(backend_ptr))
     {
         VALIDATE(m_backend, "Backend is empty! :(");
         m_backend-> template
-            validate_frontend_type<SRCommunicator<Backend, ChannelTypes...>>();
+            validate_frontend_type<BasicSRCommunicator<Backend, Policy, ChannelTypes...>>();
         std::fill(m_global_eof_counters.begin(), m_global_eof_counters.end(), 0);
-        std::fill(m_sync_counters.begin(), m_sync_counters.end(), 0);
-        std::fill(m_ack_counters.begin(), m_ack_counters.end(), 0);
+        m_direct_send = m_backend->concurrent_send();
+        for (auto& sequences : m_send_sequences) {
+            sequences = std::make_unique<std::atomic<uint32_t>[]>(size());
+        }
+        for (auto& sequences : m_fenced_sequences) {
+            sequences.resize(size(), 0);
+        }
+        for (auto& buffers : m_reassembly) {
+            buffers.resize(size());
+        }
+        for (auto& blocked : m_send_blocked) {
+            blocked.resize(size());
+        }
+        while ((size_t(1) << m_barrier_rounds) < size()) {
+            ++m_barrier_rounds;
+        }
+        for (auto& state : m_sync_states) {
+            for (auto& arrivals : state.arrivals) {
+                arrivals.resize(m_barrier_rounds, 0);
+            }
+        }
+        for_each_eof_child([this](size_t) { ++m_eof_children; });
+        m_send_quanta.fill(Policy::send_quantum);
+        m_ctrl_batch.reserve(SEND_BATCH_SIZE);
+        m_recv_touched.reserve(CHANS_AMOUNT);
     }
 
-template <class Backend, class ...ChannelTypes>
+template <class Backend, class Policy, class ...ChannelTypes>
 template <class ...BackendArgs>
-SRCommunicator<Backend, ChannelTypes...>::SRCommunicator(BackendArgs&& ...args) :
-    SRCommunicator(std::make_unique<Backend>(std::forward<BackendArgs>(args)...))
+BasicSRCommunicator<Backend, Policy, ChannelTypes...>::BasicSRCommunicator(
+    BackendArgs&& ...args) :
+    BasicSRCommunicator(std::make_unique<Backend>(std::forward<BackendArgs>(args)...))
     { }
 
-template <typename Backend, typename ...ChannelTypes>
-SRCommunicator<Backend, ChannelTypes...>::~SRCommunicator() {
+template <class Backend, class Policy, class ...ChannelTypes>
+BasicSRCommunicator<Backend, Policy, ChannelTypes...>::~BasicSRCommunicator() {
     for (size_t i = 0; i < CHANS_AMOUNT; ++i) {
         if (!m_recv_queues[i].empty()) {
             BENCH_LOG_WARN(boost::format("WARNING! receive queue %d not empty at"
                                             " Communicator destruction!") % i);
         }
-        if (!m_send_queues[i].empty()) {
+        if (!m_send_queues[i].empty() || !m_send_pending[i].empty() ||
+            m_send_blocked_count[i] > 0) {
             BENCH_LOG_WARN(boost::format("WARNING! send queue %d not empty at "
                                             "Communicator destruction!") % i);
         }
     }
 }
 
-template <class Backend, class ...ChannelTypes>
+template <class Backend, class Policy, class ...ChannelTypes>
 template <size_t CHAN_NUM>
-void SRCommunicator<Backend, ChannelTypes...>::send(
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::send(
     const meta::list::get<chan_types_list, CHAN_NUM>& obj,
     size_t dest
 ) {
@@ -56,67 +82,277 @@ void SRCommunicator<Backend, ChannelTypes...>::send(
         !m_send_queues[CHAN_NUM].eof(),
        "Cannot send on channel #" << CHAN_NUM << " after EOF has been marked."
     );
-    m_send_queues[CHAN_NUM].push({util::serialize(obj), MsgType::data, dest});
+    if (m_direct_send) {
+        while (!m_backend->may_send(dest)) {
+            std::this_thread::yield();
+        }
+        frame_t frame = make_frame(MsgType::data, CHAN_NUM, encode<CHAN_NUM>(obj));
+        m_backend->send(std::move(frame), dest);
+        count_sent(CHAN_NUM, dest);
+        return;
+    }
+    m_send_queues[CHAN_NUM].push({encode<CHAN_NUM>(obj), MsgType::data, dest});
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+template <size_t CHAN_NUM>
+auto BasicSRCommunicator<Backend, Policy, ChannelTypes...>::encode(
+    const meta::list::get<chan_types_list, CHAN_NUM>& obj
+) -> raw_msg_t {
+    raw_msg_t msg = m_buffer_pool.acquire();
+    if constexpr (RAW_CHANNELS[CHAN_NUM]) {
+        // room for a backend to append the header in place
+        msg.reserve(sizeof(obj) + sizeof(wire_header));
+        msg.assign(reinterpret_cast<const char*>(&obj), sizeof(obj));
+    } else {
+        // the payload is likely about as large as the last one
+        auto& encoded_bytes = m_encoded_bytes[CHAN_NUM];
+        msg.reserve(encoded_bytes.load(std::memory_order_relaxed) + sizeof(wire_header));
+        util::serialize(obj, msg);
+        encoded_bytes.store(msg.size(), std::memory_order_relaxed);
+        if (msg.capacity() - msg.size() < sizeof(wire_header)) {
+            msg.reserve(msg.size() + sizeof(wire_header));
+        }
+    }
+    return msg;
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+template <size_t CHAN_NUM>
+auto BasicSRCommunicator<Backend, Policy, ChannelTypes...>::decode(
+    recv_msg_t&& msg
+) {
+    meta::list::get<chan_types_list, CHAN_NUM> rv;
+    decode_into<CHAN_NUM>(std::move(msg), rv);
+    return rv;
 }
 
-template <class Backend, class ...ChannelTypes>
+template <class Backend, class Policy, class ...ChannelTypes>
 template <size_t CHAN_NUM>
-auto SRCommunicator<Backend, ChannelTypes...>::receive() {
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::decode_into(
+    recv_msg_t&& msg,
+    meta::list::get<chan_types_list, CHAN_NUM>& out
+) {
     using chan_type = meta::list::get<chan_types_list, CHAN_NUM>;
-    try {
-        RecvMsgProp rmsg = m_recv_queues[CHAN_NUM].pop();
-        while (rmsg.type == MsgType::sync || rmsg.type == MsgType::ack) {
-            handle_sync_ack_messages(rmsg, CHAN_NUM);
-            rmsg = m_recv_queues[CHAN_NUM].pop();
+    if constexpr (RAW_CHANNELS[CHAN_NUM]) {
+        VALIDATE(msg.size() == sizeof(chan_type),
+            "Bad message size on raw channel #" << CHAN_NUM);
+        std::memcpy(&out, msg.data(), sizeof(out));
+    } else {
+        util::deserialize(std::string_view(msg), out);
+    }
+    recycle(m_buffer_pool, std::move(msg));
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+auto BasicSRCommunicator<Backend, Policy, ChannelTypes...>::pop_data_msg(
+    size_t chan_num
+) -> RecvMsgProp {
+    RecvMsgProp rmsg = m_recv_queues[chan_num].pop();
+    while (rmsg.type == MsgType::sync) {
+        handle_sync_message(rmsg, chan_num);
+        rmsg = m_recv_queues[chan_num].pop();
+    }
+    return rmsg;
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+auto BasicSRCommunicator<Backend, Policy, ChannelTypes...>::try_pop_data_msg(
+    size_t chan_num
+) -> boost::optional<RecvMsgProp> {
+    auto opt_rmsg = m_recv_queues[chan_num].try_pop();
+    while (opt_rmsg && opt_rmsg->type == MsgType::sync) {
+        handle_sync_message(*opt_rmsg, chan_num);
+        opt_rmsg = m_recv_queues[chan_num].try_pop();
+    }
+    return opt_rmsg;
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+template <class OnData>
+size_t BasicSRCommunicator<Backend, Policy, ChannelTypes...>::try_pop_data_bulk(
+    size_t chan_num, size_t max_count, OnData&& on_data
+) {
+    // Per consumer thread, keeps its capacity between calls
+    thread_local std::vector<RecvMsgProp> batch;
+    batch.clear();
+    m_recv_queues[chan_num].try_pop_bulk(std::back_inserter(batch), max_count);
+    size_t data_count = 0;
+    for (auto& rmsg : batch) {
+        if (rmsg.type == MsgType::sync) {
+            handle_sync_message(rmsg, chan_num);
+        } else {
+            on_data(std::move(rmsg.data));
+            ++data_count;
         }
-        return std::optional(util::deserialize<chan_type>(rmsg.data));
+    }
+    return data_count;
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+template <size_t CHAN_NUM>
+auto BasicSRCommunicator<Backend, Policy, ChannelTypes...>::receive() {
+    using chan_type = meta::list::get<chan_types_list, CHAN_NUM>;
+    try {
+        RecvMsgProp rmsg = pop_data_msg(CHAN_NUM);
+        return std::optional(decode<CHAN_NUM>(std::move(rmsg.data)));
     } catch (squeue_eof& e) {
         return std::optional<chan_type>();
     }
 }
 
-template <class Backend, class ...ChannelTypes>
+template <class Backend, class Policy, class ...ChannelTypes>
 template <size_t CHAN_NUM>
-auto SRCommunicator<Backend, ChannelTypes...>::try_receive() {
+auto BasicSRCommunicator<Backend, Policy, ChannelTypes...>::try_receive() {
     using chan_type = meta::list::get<chan_types_list, CHAN_NUM>;
-    auto opt_rmsg = m_recv_queues[CHAN_NUM].try_pop();
-    while (opt_rmsg && (opt_rmsg->type == MsgType::sync
-                     || opt_rmsg->type == MsgType::ack)) {
-        handle_sync_ack_messages(*opt_rmsg, CHAN_NUM);
-        opt_rmsg = m_recv_queues[CHAN_NUM].try_pop();
-    }
+    auto opt_rmsg = try_pop_data_msg(CHAN_NUM);
     if (opt_rmsg) {
-        return std::make_optional(util::deserialize<chan_type>(opt_rmsg->data));
+        return std::make_optional(decode<CHAN_NUM>(std::move(opt_rmsg->data)));
     } else {
         return std::optional<chan_type>();
     }
 }
 
-template <class Backend, class ...ChannelTypes>
-bool SRCommunicator<Backend, ChannelTypes...>::is_closed(size_t ch_num) const {
+template <class Backend, class Policy, class ...ChannelTypes>
+template <size_t CHAN_NUM>
+bool BasicSRCommunicator<Backend, Policy, ChannelTypes...>::receive_into(
+    meta::list::get<chan_types_list, CHAN_NUM>& out
+) {
+    try {
+        decode_into<CHAN_NUM>(std::move(pop_data_msg(CHAN_NUM).data), out);
+        return true;
+    } catch (squeue_eof& e) {
+        return false;
+    }
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+template <size_t CHAN_NUM>
+bool BasicSRCommunicator<Backend, Policy, ChannelTypes...>::try_receive_into(
+    meta::list::get<chan_types_list, CHAN_NUM>& out
+) {
+    auto opt_rmsg = try_pop_data_msg(CHAN_NUM);
+    if (!opt_rmsg) {
+        return false;
+    }
+    decode_into<CHAN_NUM>(std::move(opt_rmsg->data), out);
+    return true;
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+template <size_t CHAN_NUM>
+size_t BasicSRCommunicator<Backend, Policy, ChannelTypes...>::try_receive_bulk(
+    meta::list::get<chan_types_list, CHAN_NUM>* out,
+    size_t max_count
+) {
+    return try_pop_data_bulk(CHAN_NUM, max_count, [&](recv_msg_t&& data) {
+        decode_into<CHAN_NUM>(std::move(data), *out++);
+    });
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+template <size_t CHAN_NUM>
+auto BasicSRCommunicator<Backend, Policy, ChannelTypes...>::receive_view() {
+    try {
+        RecvMsgProp rmsg = pop_data_msg(CHAN_NUM);
+        return std::make_optional<view_t<CHAN_NUM>>(std::move(rmsg.data), m_buffer_pool);
+    } catch (squeue_eof& e) {
+        return std::optional<view_t<CHAN_NUM>>();
+    }
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+template <size_t CHAN_NUM>
+auto BasicSRCommunicator<Backend, Policy, ChannelTypes...>::try_receive_view() {
+    auto opt_rmsg = try_pop_data_msg(CHAN_NUM);
+    if (opt_rmsg) {
+        return std::make_optional<view_t<CHAN_NUM>>(std::move(opt_rmsg->data), m_buffer_pool);
+    } else {
+        return std::optional<view_t<CHAN_NUM>>();
+    }
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+template <size_t CHAN_NUM, class OutputIt>
+size_t BasicSRCommunicator<Backend, Policy, ChannelTypes...>::try_receive_view_bulk(
+    OutputIt out, size_t max_count
+) {
+    return try_pop_data_bulk(CHAN_NUM, max_count, [&](recv_msg_t&& data) {
+        *out++ = view_t<CHAN_NUM>(std::move(data), m_buffer_pool);
+    });
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+template <size_t CHAN_NUM, class Handler>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::set_receive_handler(
+    Handler&& handler
+) {
+    m_recv_handlers[CHAN_NUM] =
+        [this, handler = std::forward<Handler>(handler)](recv_msg_t&& data) mutable {
+            handler(view_t<CHAN_NUM>(std::move(data), m_buffer_pool));
+        };
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::set_channel_weights(
+    const std::array<size_t, CHANS_AMOUNT>& weights
+) {
+    for (size_t i = 0; i < CHANS_AMOUNT; ++i) {
+        VALIDATE(weights[i] > 0, "Channel " << i << " weight must be positive");
+        m_send_quanta[i] = weights[i] * Policy::send_quantum;
+    }
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+bool BasicSRCommunicator<Backend, Policy, ChannelTypes...>::is_closed(size_t ch_num) const {
     // The channel is fully closed iff its recv queue is EOF and empty
     return m_recv_queues[ch_num].eof() && m_recv_queues[ch_num].empty();
 }
 
-template <class Backend, class ...ChannelTypes>
+template <class Backend, class Policy, class ...ChannelTypes>
+template <size_t CHAN_NUM>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::synchronize() {
+    wait_synchronize(begin_synchronize<CHAN_NUM>());
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
 template <size_t CHAN_NUM>
-void SRCommunicator<Backend, ChannelTypes...>::synchronize() {
+sync_handle BasicSRCommunicator<Backend, Policy, ChannelTypes...>::begin_synchronize() {
     BENCH_LOG_DEBUG(
         boost::format("[%d] Synchronizing channel %d") % rank() % CHAN_NUM);
-    SendMsgProp SYNC_SIGNAL = {std::to_string(rank()), MsgType::sync, 0};
+    uint64_t epoch = m_sync_requested[CHAN_NUM].fetch_add(1) + 1;
+    // Goes through the send queue, so the fences follow the data pushed before
+    SendMsgProp SYNC_SIGNAL = {{}, MsgType::sync, 0};
     m_send_queues[CHAN_NUM].push(SYNC_SIGNAL);
+    return {CHAN_NUM, epoch};
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+bool BasicSRCommunicator<Backend, Policy, ChannelTypes...>::test_synchronize(
+    const sync_handle& handle
+) const {
+    return m_sync_completed[handle.channel].load(std::memory_order_acquire) >= handle.epoch;
+}
 
-    std::unique_lock l(m_sync_mutex);
-    while (!m_synchronized) {
-        m_sync_cond.wait(l);
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::wait_synchronize(
+    const sync_handle& handle
+) {
+    auto& event = m_sync_events[handle.channel];
+    while (true) {
+        auto key = event.prepare_wait();
+        if (test_synchronize(handle)) {
+            event.cancel_wait();
+            break;
+        }
+        event.wait(key, Policy::wait_spin_count);
     }
-    m_synchronized = false;
     BENCH_LOG_DEBUG(boost::format("[%d] Synchronization of channel "
-                                 "%d complete.") % rank() % CHAN_NUM);
+                                 "%d complete.") % rank() % handle.channel);
 }
 
-template <class Backend, class ...ChannelTypes>
-void SRCommunicator<Backend, ChannelTypes...>::mark_eof(size_t ch_num) {
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::mark_eof(size_t ch_num) {
     BENCH_LOG_DEBUG(boost::format(
                        "[%d] Marking EOF on channel %d")
                        % rank() % ch_num);
@@ -126,18 +362,18 @@ void SRCommunicator<Backend, ChannelTypes...>::mark_eof(size_t ch_num) {
     m_send_queues[ch_num].mark_eof();
 }
 
-template <class Backend, class ...ChannelTypes>
-size_t SRCommunicator<Backend, ChannelTypes...>::rank() const{
+template <class Backend, class Policy, class ...ChannelTypes>
+size_t BasicSRCommunicator<Backend, Policy, ChannelTypes...>::rank() const{
     return m_backend->rank();
 }
 
-template <class Backend, class ...ChannelTypes>
-size_t SRCommunicator<Backend, ChannelTypes...>::size() const {
+template <class Backend, class Policy, class ...ChannelTypes>
+size_t BasicSRCommunicator<Backend, Policy, ChannelTypes...>::size() const {
     return m_backend->size();
 }
 
-template <class Backend, class ...ChannelTypes>
-void SRCommunicator<Backend, ChannelTypes...>::increment_eof_counter(
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::increment_eof_counter(
     size_t chan_num
 ) {
     m_global_eof_counters[chan_num]++;
@@ -150,50 +386,216 @@ void SRCommunicator<Backend, ChannelTypes...>::increment_eof_counter(
         BENCH_LOG_DEBUG(boost::format(
                            "[%d] COMM channel %d is now closed!")
                            % rank() % chan_num);
-        m_recv_cond.notify_all();
+        notify_recv(chan_num);
     }
 }
 
-template <class Backend, class ...ChannelTypes>
-void SRCommunicator<Backend, ChannelTypes...>::increment_sync_counter(
-    size_t chan_num
+template <class Backend, class Policy, class ...ChannelTypes>
+size_t BasicSRCommunicator<Backend, Policy, ChannelTypes...>::eof_parent() const {
+    // clear the lowest set bit
+    return rank() & (rank() - 1);
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+template <class F>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::for_each_eof_child(F&& f) const {
+    // children are rank + 2^k, for 2^k below the lowest set bit of rank
+    for (size_t bit = 1; rank() + bit < size(); bit <<= 1) {
+        if (rank() & bit) {
+            break;
+        }
+        f(rank() + bit);
+    }
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::begin_eof(size_t chan_num) {
+    auto& state = m_eof_states[chan_num];
+    state.local = true;
+    auto& sent = m_send_sequences[chan_num];
+    auto& fenced = m_fenced_sequences[chan_num];
+    for (size_t dest = 0; dest < size(); ++dest) {
+        uint32_t count = sent[dest].load(std::memory_order_acquire);
+        if (count != fenced[dest]) {
+            send_fence(MsgType::eof_fence, chan_num, dest);
+            fenced[dest] = count;
+            ++state.pending_acks;
+        }
+    }
+    try_report_eof(chan_num);
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::try_report_eof(size_t chan_num) {
+    auto& state = m_eof_states[chan_num];
+    if (state.reported || !state.local || state.pending_acks > 0 ||
+        state.children_done < m_eof_children) {
+        return;
+    }
+    state.reported = true;
+    if (rank() == 0) {
+        close_channel(chan_num);
+    } else {
+        send_control(MsgType::eof_done, chan_num, eof_parent());
+    }
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::close_channel(size_t chan_num) {
+    for_each_eof_child([this, chan_num](size_t child) {
+        send_control(MsgType::eof_close, chan_num, child);
+    });
+    m_recv_queues[chan_num].mark_eof();
+    BENCH_LOG_DEBUG(boost::format(
+                       "[%d] COMM channel %d is now closed!")
+                       % rank() % chan_num);
+    notify_recv(chan_num);
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::handle_sync_message(
+    const RecvMsgProp& msg, size_t chan_num
+) {
+    VALIDATE(msg.type == MsgType::sync, "Message type is not sync!");
+    m_ctrl_queue.push({MsgType::ack, chan_num, msg.source});
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+typename BasicSRCommunicator<Backend, Policy, ChannelTypes...>::frame_t
+BasicSRCommunicator<Backend, Policy, ChannelTypes...>::make_frame(
+    MsgType type, size_t chan_num, raw_msg_t&& payload
+) const {
+    // Frame structure: {header, data}, the data is left untouched
+    frame_t frame{{}, std::move(payload)};
+    frame.header.type = static_cast<uint8_t>(type);
+    frame.header.channel = static_cast<uint16_t>(chan_num);
+    frame.header.source = static_cast<uint32_t>(rank());
+    frame.header.length = static_cast<uint32_t>(frame.payload.size());
+    return frame;
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::count_sent(
+    size_t chan_num, size_t dest
 ) {
-    if (++m_sync_counters[chan_num] == size()) {
-        send_ack(chan_num);
+    auto& sent = m_send_sequences[chan_num][dest];
+    if (m_direct_send) {
+        sent.fetch_add(1, std::memory_order_release);
+    } else {
+        // Only the run() thread counts, it needs no atomic increment
+        sent.store(sent.load(std::memory_order_relaxed) + 1, std::memory_order_release);
     }
 }
 
-template <class Backend, class ...ChannelTypes>
-void SRCommunicator<Backend, ChannelTypes...>::send_ack(size_t chan_num) {
-    SendMsgProp ACK_SIGNAL = {std::to_string(rank()), MsgType::ack, 0};
-    m_send_queues[chan_num].push(ACK_SIGNAL);
+template <class Backend, class Policy, class ...ChannelTypes>
+typename BasicSRCommunicator<Backend, Policy, ChannelTypes...>::frame_t
+BasicSRCommunicator<Backend, Policy, ChannelTypes...>::control_frame(
+    MsgType type, size_t chan_num, uint32_t sequence, uint8_t flags
+) const {
+    frame_t frame{{}, {}};
+    frame.header.type = static_cast<uint8_t>(type);
+    frame.header.flags = flags;
+    frame.header.channel = static_cast<uint16_t>(chan_num);
+    frame.header.source = static_cast<uint32_t>(rank());
+    frame.header.length = 0;
+    frame.header.sequence = sequence;
+    return frame;
 }
 
-template <class Backend, class ...ChannelTypes>
-void SRCommunicator<Backend, ChannelTypes...>::increment_ack_counter(
-    size_t chan_num
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::send_control(
+    MsgType type, size_t chan_num, size_t dest, uint32_t sequence, uint8_t flags
+) {
+    m_backend->send_control(control_frame(type, chan_num, sequence, flags), dest);
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::send_fence(
+    MsgType type, size_t chan_num, size_t dest
 ) {
-    if (++m_ack_counters[chan_num] == size()) {
-        std::unique_lock l(m_sync_mutex);
-        m_synchronized = true;
-        m_sync_cond.notify_all();
-        VALIDATE(m_sync_counters[chan_num] >= size(),
-            "Internal error during comm synchronization");
-        m_sync_counters[chan_num] -= size();
-        m_ack_counters[chan_num] -= size();
+    m_backend->send(control_frame(type, chan_num), dest);
+    m_backend->flush_send_buffer(dest);
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::begin_sync(size_t chan_num) {
+    auto& state = m_sync_states[chan_num];
+    if (state.active) {
+        ++state.deferred;
+        return;
+    }
+    state.active = true;
+    state.round = 0;
+    state.round_sent = false;
+    state.pending_acks = 0;
+
+    // Fence only the destinations that got data since the last fence
+    auto& sent = m_send_sequences[chan_num];
+    auto& fenced = m_fenced_sequences[chan_num];
+    for (size_t dest = 0; dest < size(); ++dest) {
+        uint32_t count = sent[dest].load(std::memory_order_acquire);
+        if (count != fenced[dest]) {
+            send_fence(MsgType::sync, chan_num, dest);
+            fenced[dest] = count;
+            ++state.pending_acks;
+        }
+    }
+    if (state.pending_acks == 0) {
+        advance_barrier(chan_num);
+    }
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::handle_ack(size_t chan_num) {
+    auto& state = m_sync_states[chan_num];
+    VALIDATE(state.active && state.pending_acks > 0,
+        "Unexpected sync ack on channel " << chan_num);
+    if (--state.pending_acks == 0) {
+        advance_barrier(chan_num);
     }
 }
 
-template <class Backend, class ...ChannelTypes>
-void SRCommunicator<Backend, ChannelTypes...>::handle_sync_ack_messages(
-    RecvMsgProp msg, size_t chan_num
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::handle_barrier(
+    size_t chan_num, uint32_t epoch, size_t round
 ) {
-    if (msg.type == MsgType::sync) {
-        increment_sync_counter(chan_num);
-    } else if (msg.type == MsgType::ack){
-        increment_ack_counter(chan_num);
-    } else {
-        throw std::invalid_argument("Message type is not sync or ack!");
+    auto& state = m_sync_states[chan_num];
+    DEBUG_VALIDATE(round < m_barrier_rounds, "Bad barrier round " << round);
+    state.arrivals[epoch % 2][round]++;
+    if (state.active && state.epoch == epoch && state.pending_acks == 0) {
+        advance_barrier(chan_num);
+    }
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::advance_barrier(size_t chan_num) {
+    auto& state = m_sync_states[chan_num];
+    auto& arrivals = state.arrivals[state.epoch % 2];
+    while (true) {
+        if (!state.round_sent) {
+            if (state.round == m_barrier_rounds) {
+                break;
+            }
+            // Round r: notify rank + 2^r, wait for rank - 2^r
+            size_t dest = (rank() + (size_t(1) << state.round)) % size();
+            send_control(MsgType::barrier, chan_num, dest, state.epoch,
+                         static_cast<uint8_t>(state.round));
+            state.round_sent = true;
+        }
+        if (arrivals[state.round] == 0) {
+            return;
+        }
+        --arrivals[state.round];
+        ++state.round;
+        state.round_sent = false;
+    }
+    state.active = false;
+    ++state.epoch;
+    m_sync_completed[chan_num].store(state.epoch, std::memory_order_release);
+    m_sync_events[chan_num].notify_all();
+    if (state.deferred > 0) {
+        --state.deferred;
+        begin_sync(chan_num);
     }
 }
 
@@ -207,72 +609,280 @@ std::string to_hex(const std::string& str) {
     return ss.str();
 }
 
-template <class Backend, class ...ChannelTypes>
-void SRCommunicator<Backend, ChannelTypes...>::poll_and_handle_send_queues() {
-    size_t chan_id = 0;
-    for (auto& sq : m_send_queues) {
-        boost::optional<SendMsgProp> msg = sq.try_pop();
-        while (msg) {
-            // Packet structure: {data, msg_type, channel_id}
-            raw_msg_t backend_msg = std::move(msg->data);
-            backend_msg.push_back(static_cast<uint8_t>(msg->msg_type));
-            backend_msg.push_back(chan_id);
-
-            if (msg->msg_type == MsgType::data) {
-                m_backend->send(std::move(backend_msg), msg->dest);
-            } else { // EOF, sync or ACK messages
-                m_backend->broadcast(std::move(backend_msg));
-                // We empty the backend's buffers when sending these messages
-                m_backend->flush_send_buffers();
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::poll_and_handle_send_queues() {
+    for (size_t chan_id = 0; chan_id < CHANS_AMOUNT; ++chan_id) {
+        auto& sq = m_send_queues[chan_id];
+        auto& pending = m_send_pending[chan_id];
+        auto& deficit = m_send_deficits[chan_id];
+        auto& blocked_count = m_send_blocked_count[chan_id];
+        // Pop in batches, taking the queue's lock (if any) once per batch
+        // rather than once per message
+        if (pending.empty() && !sq.try_pop_bulk(std::back_inserter(pending), SEND_BATCH_SIZE) &&
+            blocked_count == 0) {
+            // An idle channel doesn't save up credit
+            deficit = 0;
+            continue;
+        }
+        deficit += m_send_quanta[chan_id];
+        // The messages set aside are older than the pending ones
+        if (!send_blocked(chan_id, deficit)) {
+            continue;
+        }
+        while (!pending.empty()) {
+            auto& msg = pending.front();
+            if (msg.msg_type == MsgType::data) {
+                auto& blocked = m_send_blocked[chan_id][msg.dest];
+                if (blocked.empty() && m_backend->may_send(msg.dest)) {
+                    if (!send_data(chan_id, msg, deficit)) {
+                        break;
+                    }
+                } else if (blocked_count < MAX_SEND_BLOCKED) {
+                    // The destination is congested: its messages wait aside,
+                    // in order, and the channel goes on with the others
+                    blocked.push_back(std::move(msg));
+                    ++blocked_count;
+                } else {
+                    // The channel waits as a whole, and saves no credit meanwhile
+                    deficit = 0;
+                    break;
+                }
+            } else {
+                // Sync and EOF markers follow all the data before them
+                if (blocked_count > 0) {
+                    deficit = 0;
+                    break;
+                }
+                size_t cost = sizeof(wire_header) + msg.data.size();
+                if (cost > deficit) {
+                    break;
+                }
+                deficit -= cost;
+                handle_send_msg(chan_id, std::move(msg));
             }
-            if (msg->msg_type == MsgType::eof) {
-                BENCH_LOG_DEBUG(boost::format(
-                                   "[%d] Sending EOF on channel %s")
-                                   % rank() % chan_id);
+            pending.pop_front();
+            if (pending.empty()) {
+                sq.try_pop_bulk(std::back_inserter(pending), SEND_BATCH_SIZE);
+            }
+        }
+        if (pending.empty()) {
+            // Waiting on congested destinations saves no credit either
+            deficit = 0;
+        }
+    }
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+bool BasicSRCommunicator<Backend, Policy, ChannelTypes...>::send_blocked(
+    size_t chan_id, size_t& deficit
+) {
+    auto& blocked_count = m_send_blocked_count[chan_id];
+    for (size_t dest = 0; blocked_count > 0 && dest < size(); ++dest) {
+        auto& blocked = m_send_blocked[chan_id][dest];
+        while (!blocked.empty() && m_backend->may_send(dest)) {
+            if (!send_data(chan_id, blocked.front(), deficit)) {
+                return false;
             }
-            msg = sq.try_pop();
+            blocked.pop_front();
+            --blocked_count;
+        }
+    }
+    return true;
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+bool BasicSRCommunicator<Backend, Policy, ChannelTypes...>::send_data(
+    size_t chan_id, SendMsgProp& msg, size_t& deficit
+) {
+    if (msg.data.size() > Policy::fragment_size) {
+        return send_fragments(chan_id, msg, deficit);
+    }
+    size_t cost = sizeof(wire_header) + msg.data.size();
+    if (cost > deficit) {
+        return false;
+    }
+    deficit -= cost;
+    handle_send_msg(chan_id, std::move(msg));
+    return true;
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+bool BasicSRCommunicator<Backend, Policy, ChannelTypes...>::send_fragments(
+    size_t chan_id, SendMsgProp& msg, size_t& deficit
+) {
+    auto& offset = msg.sent;
+    size_t total = msg.data.size();
+    VALIDATE(total <= std::numeric_limits<uint32_t>::max(),
+        "Message of " << total << " bytes is too large on channel " << chan_id);
+    while (offset < total) {
+        size_t length = std::min(Policy::fragment_size, total - offset);
+        size_t cost = sizeof(wire_header) + length;
+        if (cost > deficit) {
+            return false;
         }
-        chan_id++;
+        deficit -= cost;
+        // msg stays queued until its last fragment is out, so the fragments
+        // are sent right out of its buffer
+        wire_slice fragment{{}, msg.data.data() + offset, length};
+        fragment.header.type = static_cast<uint8_t>(MsgType::fragment);
+        fragment.header.channel = static_cast<uint16_t>(chan_id);
+        fragment.header.source = static_cast<uint32_t>(rank());
+        fragment.header.length = static_cast<uint32_t>(length);
+        fragment.header.sequence = static_cast<uint32_t>(total);
+        m_backend->send_slice(fragment, msg.dest);
+        offset += length;
+    }
+    // fences count messages, not fragments
+    count_sent(chan_id, msg.dest);
+    m_buffer_pool.release(std::move(msg.data));
+    return true;
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+std::optional<typename BasicSRCommunicator<Backend, Policy, ChannelTypes...>::raw_msg_t>
+BasicSRCommunicator<Backend, Policy, ChannelTypes...>::reassemble(
+    size_t chan_id, recv_frame_t&& frame
+) {
+    auto& buffer = m_reassembly[chan_id][frame.header.source];
+    size_t total = frame.header.sequence;
+    if (buffer.empty()) {
+        // allocated once for the whole message
+        buffer = m_buffer_pool.acquire(total);
+    }
+    buffer.insert(buffer.end(), frame.payload.begin(), frame.payload.end());
+    recycle(m_buffer_pool, std::move(frame.payload));
+    DEBUG_VALIDATE(buffer.size() <= total,
+        "Fragment overflows its message on channel " << chan_id);
+    if (buffer.size() < total) {
+        return std::nullopt;
+    }
+    return std::exchange(buffer, raw_msg_t{});
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::handle_send_msg(
+    size_t chan_id, SendMsgProp&& msg
+) {
+    frame_t frame = make_frame(msg.msg_type, chan_id, std::move(msg.data));
+
+    if (msg.msg_type == MsgType::data) {
+        m_backend->send(std::move(frame), msg.dest);
+        count_sent(chan_id, msg.dest);
+    } else if (msg.msg_type == MsgType::sync) {
+        begin_sync(chan_id);
+    } else if constexpr (Policy::tree_eof) {
+        begin_eof(chan_id);
+    } else { // EOF messages
+        m_backend->broadcast(frame);
+        // We empty the backend's buffers when sending these messages
+        m_backend->flush_send_buffers();
+    }
+    if (msg.msg_type == MsgType::eof) {
+        BENCH_LOG_DEBUG(boost::format(
+                           "[%d] Sending EOF on channel %s")
+                           % rank() % chan_id);
+    }
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::poll_and_handle_ctrl_queue() {
+    if (m_ctrl_queue.empty()) {
+        return;
+    }
+    m_ctrl_queue.try_pop_bulk(std::back_inserter(m_ctrl_batch), SEND_BATCH_SIZE);
+    for (auto& msg : m_ctrl_batch) {
+        send_control(msg.msg_type, msg.chan, msg.dest);
     }
+    m_ctrl_batch.clear();
 }
 
-template <class Backend, class ...ChannelTypes>
-void SRCommunicator<Backend, ChannelTypes...>::poll_and_handle_recv_backend() {
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::poll_and_handle_recv_backend() {
     auto opt_recv_vector = m_backend->try_receive();
     if (opt_recv_vector) {
-        for (auto&& backend_msg : *opt_recv_vector) {
-            // Packet structure: {data, msg_type, channel_id}
-            uint8_t chan_id = backend_msg.back();
-            backend_msg.pop_back();
-            MsgType msg_type = static_cast<MsgType>(backend_msg.back());
-            backend_msg.pop_back();
+        auto mark_touched = [this](size_t chan_id) {
+            if (!m_recv_touched_flags[chan_id]) {
+                m_recv_touched_flags[chan_id] = true;
+                m_recv_touched.push_back(chan_id);
+            }
+        };
+        auto deliver = [this, &mark_touched](size_t chan_id, recv_msg_t&& data) {
+            auto& handler = m_recv_handlers[chan_id];
+            if (handler) {
+                handler(std::move(data));
+            } else {
+                m_recv_queues[chan_id].push(std::move(data));
+                mark_touched(chan_id);
+            }
+        };
+        for (auto&& frame : *opt_recv_vector) {
+            size_t chan_id = frame.header.channel;
+            MsgType msg_type = static_cast<MsgType>(frame.header.type);
+            DEBUG_VALIDATE(frame.payload.size() == frame.header.length,
+                           "Frame length mismatch on channel " << chan_id);
+            auto& handler = m_recv_handlers[chan_id];
             if (msg_type == MsgType::eof) {
                 increment_eof_counter(chan_id);
-            } else if (msg_type == MsgType::sync || msg_type == MsgType::ack) {
-                m_recv_queues[chan_id].push(msg_type);
+            } else if (msg_type == MsgType::sync) {
+                RecvMsgProp sync_msg(msg_type, frame.header.source);
+                if (handler) {
+                    handle_sync_message(sync_msg, chan_id);
+                } else {
+                    m_recv_queues[chan_id].push(std::move(sync_msg));
+                    mark_touched(chan_id);
+                }
+            } else if (msg_type == MsgType::ack) {
+                handle_ack(chan_id);
+            } else if (msg_type == MsgType::eof_fence) {
+                // the data sent before the fence is already queued
+                send_control(MsgType::eof_ack, chan_id, frame.header.source);
+            } else if (msg_type == MsgType::eof_ack) {
+                VALIDATE(m_eof_states[chan_id].pending_acks > 0,
+                    "Unexpected EOF ack on channel " << chan_id);
+                --m_eof_states[chan_id].pending_acks;
+                try_report_eof(chan_id);
+            } else if (msg_type == MsgType::eof_done) {
+                ++m_eof_states[chan_id].children_done;
+                try_report_eof(chan_id);
+            } else if (msg_type == MsgType::eof_close) {
+                close_channel(chan_id);
+            } else if (msg_type == MsgType::barrier) {
+                handle_barrier(chan_id, frame.header.sequence, frame.header.flags);
+            } else if (msg_type == MsgType::fragment) {
+                auto data = reassemble(chan_id, std::move(frame));
+                if (data) {
+                    deliver(chan_id, recv_msg_t(std::move(*data)));
+                }
             } else {
                 VALIDATE(msg_type == MsgType::data, "Fatal error in communicator!");
-                m_recv_queues[chan_id].push(std::move(backend_msg));
+                deliver(chan_id, std::move(frame.payload));
             }
         }
-        m_recv_cond.notify_all();
+        // One wakeup per channel and poll, rather than per message
+        for (size_t chan_id : m_recv_touched) {
+            m_recv_touched_flags[chan_id] = false;
+            notify_recv(chan_id);
+        }
+        m_recv_touched.clear();
     }
 }
 
-template <class Backend, class ...ChannelTypes>
-bool SRCommunicator<Backend, ChannelTypes...>::all_done() const {
+template <class Backend, class Policy, class ...ChannelTypes>
+bool BasicSRCommunicator<Backend, Policy, ChannelTypes...>::all_done() const {
     for (size_t i = 0; i < CHANS_AMOUNT; ++i) {
         if (!is_closed(i)) { return false; }
     }
     return true;
 }
 
-template <class Backend, class ...ChannelTypes>
-bool SRCommunicator<Backend, ChannelTypes...>::send_done() {
+template <class Backend, class Policy, class ...ChannelTypes>
+bool BasicSRCommunicator<Backend, Policy, ChannelTypes...>::send_done() {
     if (m_send_done) {
         return true;
     } else if (std::all_of(m_send_queues.begin(), m_send_queues.end(),
                        [](auto& q) {return q.eof() && q.empty();}) &&
+         std::all_of(m_send_pending.begin(), m_send_pending.end(),
+                       [](auto& p) {return p.empty();}) &&
          m_backend->done_sending()) {
         m_send_done = true;
         BENCH_LOG_DEBUG(boost::format("[%d] All send queues closed") % rank());
@@ -281,37 +891,67 @@ bool SRCommunicator<Backend, ChannelTypes...>::send_done() {
     return false;
 }
 
-template <class Backend, class ...ChannelTypes>
-void SRCommunicator<Backend, ChannelTypes...>::run() {
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::run() {
     VALIDATE(!m_all_done, "Cannot run communicator, "
                                  "all channels already closed");
     while (!all_done()) {
         if (!send_done()) {
             poll_and_handle_send_queues();
         }
+        // Acks keep flowing after this node's send queues are done
+        poll_and_handle_ctrl_queue();
         poll_and_handle_recv_backend();
-        if (m_flush_timer.elapsed() > FLUSH_INTERVAL_SEC) {
-            m_backend->flush_send_buffers();
-            m_flush_timer.reset();
-        }
+        // Buffers that did not fill up go out once they reach the latency target
+        m_backend->flush_expired_buffers();
     }
     BENCH_LOG_DEBUG(boost::format("[%d] COMM all done") % rank());
     m_all_done = true;
     m_extraction_cond.notify_all();
 }
 
-template <class Backend, class ...ChannelTypes>
-void SRCommunicator<Backend, ChannelTypes...>::wait_recv() {
-    const size_t WAIT_TIME = 500;
-    std::mutex m;
-    std::unique_lock<std::mutex> lk(m);
-    // Heuristic. Avoids busy wait without actually synchronizing
-    m_recv_cond.wait_for(lk, std::chrono::milliseconds(WAIT_TIME));
+template <class Backend, class Policy, class ...ChannelTypes>
+bool BasicSRCommunicator<Backend, Policy, ChannelTypes...>::recv_ready(size_t ch_num) const {
+    return !m_recv_queues[ch_num].empty() || m_recv_queues[ch_num].eof();
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::notify_recv(size_t ch_num) {
+    m_recv_events[ch_num].notify_all();
+    m_any_recv_event.notify_all();
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::wait_recv() {
+    auto key = m_any_recv_event.prepare_wait();
+    bool all_eof = true;
+    for (size_t i = 0; i < CHANS_AMOUNT; ++i) {
+        if (!m_recv_queues[i].empty()) {
+            m_any_recv_event.cancel_wait();
+            return;
+        }
+        all_eof = all_eof && m_recv_queues[i].eof();
+    }
+    if (all_eof) {
+        m_any_recv_event.cancel_wait();
+        return;
+    }
+    m_any_recv_event.wait(key, Policy::wait_spin_count);
+}
+
+template <class Backend, class Policy, class ...ChannelTypes>
+void BasicSRCommunicator<Backend, Policy, ChannelTypes...>::wait_recv(size_t ch_num) {
+    auto key = m_recv_events[ch_num].prepare_wait();
+    if (recv_ready(ch_num)) {
+        m_recv_events[ch_num].cancel_wait();
+        return;
+    }
+    m_recv_events[ch_num].wait(key, Policy::wait_spin_count);
 }
 
-template <class Backend, class ...ChannelTypes>
+template <class Backend, class Policy, class ...ChannelTypes>
 std::unique_ptr<Backend>
-    SRCommunicator<Backend, ChannelTypes...>::extract_backend() {
+    BasicSRCommunicator<Backend, Policy, ChannelTypes...>::extract_backend() {
     std::mutex m;
     std::unique_lock<std::mutex> lk(m);
     while (!m_all_done) {
@@ -0,0 +1,60 @@
+#include <algorithm>
+#include <util/accurate_timer.h>
+#include <util/validate.h>
+#include "flush_policy.h"
+
+namespace ib_bench {
+
+flush_policy::flush_policy(const flush_config& config, size_t destinations) :
+    m_config(config),
+    m_dests(destinations)
+{
+    VALIDATE(m_config.max_messages > 0, "Flush message threshold must be positive");
+    // adaptive mode starts small, favoring latency, and grows under load
+    m_batch_messages = m_config.adaptive ?
+        std::max<size_t>(1, m_config.max_messages / 16) : m_config.max_messages;
+}
+
+bool flush_policy::on_buffered(size_t dest, size_t bytes) {
+    auto& state = m_dests[dest];
+    if (state.messages++ == 0) {
+        state.oldest = now();
+        m_next_deadline = std::min(m_next_deadline, state.oldest + m_config.max_latency_sec);
+    }
+    state.bytes += bytes;
+    return state.messages >= m_batch_messages || state.bytes >= m_config.max_bytes;
+}
+
+void flush_policy::on_flushed(size_t dest, size_t in_flight) {
+    m_dests[dest] = dest_state();
+    if (!m_config.adaptive) {
+        return;
+    }
+    if (in_flight > m_dests.size()) {
+        // sends complete slower than we issue them, batch more per send
+        m_batch_messages = std::min(m_batch_messages * 2, m_config.max_messages);
+    } else if (in_flight == 0) {
+        // the backend keeps up, trade some batching for latency
+        m_batch_messages = std::max<size_t>(1, m_batch_messages * 3 / 4);
+    }
+}
+
+bool flush_policy::expired(size_t dest, double now) const {
+    const auto& state = m_dests[dest];
+    return state.messages > 0 && now - state.oldest >= m_config.max_latency_sec;
+}
+
+void flush_policy::update_deadline() {
+    m_next_deadline = NO_DEADLINE;
+    for (const auto& state : m_dests) {
+        if (state.messages > 0) {
+            m_next_deadline = std::min(m_next_deadline, state.oldest + m_config.max_latency_sec);
+        }
+    }
+}
+
+double flush_policy::now() {
+    return accurate_timer::time();
+}
+
+}
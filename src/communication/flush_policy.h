@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+namespace ib_bench {
+
+/// Thresholds that decide when a backend flushes a destination's send buffer
+struct flush_config {
+    /// Flush once this many messages are buffered for a destination
+    size_t max_messages = 1000;
+    /// Flush once this many payload bytes are buffered for a destination
+    size_t max_bytes = 1 << 20;
+    /// Flush a destination whose oldest buffered message waited this long
+    double max_latency_sec = 1e-3;
+    /**
+     * Tune the message threshold between 1 and max_messages by the backend's
+     * completion rate: grow it while sends pile up in the backend, shrink it
+     * while the backend keeps up.
+     */
+    bool adaptive = false;
+    /**
+     * UCX backend: messages of at least this many bytes skip the send buffer
+     * and go out at once, without a copy. 0 probes a threshold at startup,
+     * a heuristic: the size from which copying into the send buffer costs
+     * more than one more send, timed on this rank against itself. It is not
+     * UCX's eager/rendezvous crossover, nor measured against a remote peer.
+     */
+    size_t direct_bytes = 0;
+    /**
+     * MPI backend: pack frames into contiguous byte buffers sent with plain
+     * MPI_Isend, instead of sending vectors of frames with Boost.Serialization.
+     * All ranks must agree.
+     */
+    bool raw_mpi = false;
+    /**
+     * MPI backend, raw mode: send buffers kept per destination, and reused
+     * once their sends complete. More are added while all are in flight.
+     */
+    size_t send_slabs = 2;
+    /**
+     * MPI backend: require MPI_THREAD_MULTIPLE, and let sender threads call
+     * send() themselves. Each destination's buffer has a lock of its own, so
+     * threads sending to different destinations pack in parallel.
+     */
+    bool thread_multiple = false;
+    /**
+     * Backpressure: while this many bytes sent to a destination have not
+     * completed, the communicator holds back further data for it (see the
+     * backends' may_send()), and goes on with the other destinations.
+     * 0 means no limit.
+     */
+    size_t max_outstanding_bytes = 0;
+    /// UCX backend: receives kept posted for incoming data
+    size_t recv_slots = 16;
+    /**
+     * UCX backend: size of every posted receive, thus the largest batch.
+     * Larger messages are announced, and received by a receive of their own.
+     */
+    size_t recv_slot_bytes = 1 << 20;
+    /**
+     * SHMEM backend: size of the ring in the symmetric heap that every rank
+     * keeps for each peer, thus the largest batch. All ranks must agree.
+     */
+    size_t shmem_ring_bytes = 1 << 20;
+};
+
+/**
+ * Tracks the send buffer of every destination of a backend, and tells the
+ * backend when to flush one, by message count, byte count or age of the
+ * oldest message (see flush_config).
+ */
+class flush_policy {
+public:
+    explicit flush_policy(const flush_config& config = {}, size_t destinations = 0);
+
+    /**
+     * Records a message of the given size buffered for dest.
+     * @return true if dest's buffer should be flushed now
+     */
+    bool on_buffered(size_t dest, size_t bytes);
+
+    /**
+     * Records that dest's buffer was flushed.
+     * @param in_flight Send requests the backend still waits for
+     */
+    void on_flushed(size_t dest, size_t in_flight);
+
+    /// @return true if some buffer may hold a message older than the target
+    bool any_expired(double now) const {
+        return now >= m_next_deadline;
+    }
+
+    /// @return true if dest holds a message older than the latency target
+    bool expired(size_t dest, double now) const;
+
+    /// Recomputes the earliest deadline, after expired buffers were flushed
+    void update_deadline();
+
+    /// The current message threshold
+    size_t batch_messages() const {
+        return m_batch_messages;
+    }
+
+    const flush_config& config() const {
+        return m_config;
+    }
+
+    /// Current time, in the clock used for the latency target
+    static double now();
+
+private:
+    struct dest_state {
+        size_t messages = 0;
+        size_t bytes = 0;
+        /// Buffering time of the oldest message, valid if messages > 0
+        double oldest = 0;
+    };
+
+    static constexpr double NO_DEADLINE = std::numeric_limits<double>::infinity();
+
+    flush_config m_config;
+    size_t m_batch_messages;
+    std::vector<dest_state> m_dests;
+    double m_next_deadline = NO_DEADLINE;
+};
+
+}
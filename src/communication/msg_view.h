@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <utility>
+
+#include <util/buffer_pool.h>
+#include <util/serialization.h>
+#include <util/validate.h>
+
+namespace ib_bench {
+
+/**
+ * A borrowed, typed view of a received message. The view owns the payload
+ * buffer the backend received into, and hands it back to the communicator's
+ * buffer pool when destroyed, so reading a message never copies the payload
+ * out of it.
+ *
+ * Raw channel types (see util::is_raw_serializable) are read in place with
+ * get(). Other types are only deserialized on demand, with load().
+ *
+ * @tparam T      The channel type
+ * @tparam Buffer The backend's received message type
+ * @tparam Pooled The buffer type of the pool, see recycle()
+ */
+template <class T, class Buffer, class Pooled = Buffer>
+class msg_view {
+public:
+    static constexpr bool is_raw = util::is_raw_serializable_v<T>;
+
+    msg_view(Buffer&& buffer, buffer_pool<Pooled>& pool) :
+        m_buffer(std::move(buffer)),
+        m_pool(&pool)
+    {
+        if constexpr (is_raw) {
+            VALIDATE(m_buffer.size() == sizeof(T), "Bad message size on raw channel");
+        }
+    }
+
+    msg_view(msg_view&& other) :
+        m_buffer(std::move(other.m_buffer)),
+        m_pool(std::exchange(other.m_pool, nullptr))
+    { }
+
+    msg_view& operator=(msg_view&& other) {
+        release();
+        m_buffer = std::move(other.m_buffer);
+        m_pool = std::exchange(other.m_pool, nullptr);
+        return *this;
+    }
+
+    msg_view(const msg_view&) = delete;
+    msg_view& operator=(const msg_view&) = delete;
+
+    ~msg_view() {
+        release();
+    }
+
+    /// The message, in place. Valid as long as the view is.
+    const T& get() const {
+        static_assert(is_raw, "Only raw channel types can be viewed in place, use load()");
+        DEBUG_VALIDATE(reinterpret_cast<uintptr_t>(m_buffer.data()) % alignof(T) == 0,
+                       "Misaligned receive buffer");
+        return *reinterpret_cast<const T*>(m_buffer.data());
+    }
+
+    const T& operator*() const {
+        return get();
+    }
+
+    const T* operator->() const {
+        return &get();
+    }
+
+    /// A copy of the message
+    T load() const {
+        if constexpr (is_raw) {
+            return get();
+        } else {
+            return util::deserialize<T>(bytes());
+        }
+    }
+
+    /// The message as it arrived on the wire
+    std::string_view bytes() const {
+        return std::string_view(m_buffer.data(), m_buffer.size());
+    }
+
+private:
+    void release() {
+        if (m_pool) {
+            recycle(*m_pool, std::move(m_buffer));
+            m_pool = nullptr;
+        }
+    }
+
+    Buffer m_buffer;
+    buffer_pool<Pooled>* m_pool;
+};
+
+}
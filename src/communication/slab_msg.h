@@ -0,0 +1,115 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <util/buffer_pool.h>
+#include "wire_header.h"
+
+namespace ib_bench {
+
+/**
+ * Bytes received in one piece, which frames are read from in place. Unlike
+ * a std::string it is never cleared or zero-filled, so refilling a pooled
+ * one costs nothing. Meets buffer_pool's requirements.
+ */
+class recv_slab {
+public:
+    char* data() { return m_bytes.get(); }
+    const char* data() const { return m_bytes.get(); }
+    size_t capacity() const { return m_capacity; }
+
+    /// Makes room for at least n bytes, the content is lost if it grows
+    void reserve(size_t n) {
+        if (n > m_capacity) {
+            m_bytes.reset(new char[n]);
+            m_capacity = n;
+        }
+    }
+
+    /// The content is simply written over
+    void clear() { }
+
+private:
+    std::unique_ptr<char[]> m_bytes;
+    size_t m_capacity = 0;
+};
+
+/**
+ * A slab of at least the given size from the pool. It goes back to the pool
+ * when the last reference to it, usually the last slab_msg, is released,
+ * on whichever thread that happens.
+ */
+inline std::shared_ptr<recv_slab> acquire_recv_slab(
+    const std::shared_ptr<buffer_pool<recv_slab>>& pool, size_t bytes
+) {
+    return std::shared_ptr<recv_slab>(
+        new recv_slab(pool->acquire(bytes)),
+        [pool](recv_slab* slab) {
+            pool->release(std::move(*slab));
+            delete slab;
+        }
+    );
+}
+
+/**
+ * A received payload: either a buffer of its own, or a part of a recv_slab
+ * that it shares with the other frames received in it. Read-only, with the
+ * std::string interface that the communicator reads received payloads with.
+ */
+class slab_msg {
+public:
+    slab_msg() = default;
+
+    /// A payload of its own, such as a reassembled message
+    slab_msg(std::string&& owned) :
+        m_owned(std::move(owned))
+    { }
+
+    /// size bytes of the slab from offset, which the payload keeps alive
+    slab_msg(std::shared_ptr<const recv_slab> slab, size_t offset, size_t size) :
+        m_slab(std::move(slab)),
+        m_data(m_slab->data() + offset),
+        m_size(size)
+    { }
+
+    const char* data() const { return m_slab ? m_data : m_owned.data(); }
+    size_t size() const { return m_slab ? m_size : m_owned.size(); }
+    bool empty() const { return size() == 0; }
+    const char* begin() const { return data(); }
+    const char* end() const { return data() + size(); }
+
+    explicit operator std::string_view() const {
+        return std::string_view(data(), size());
+    }
+
+    /// Lets go of the slab, and hands over the payload's own buffer, if any
+    std::string release() && {
+        m_slab.reset();
+        return std::move(m_owned);
+    }
+
+private:
+    std::string m_owned;
+    std::shared_ptr<const recv_slab> m_slab;
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+};
+
+/// Returns a payload's own buffer to the pool, a slab's part only drops its reference
+inline void recycle(buffer_pool<std::string>& pool, slab_msg&& msg) {
+    pool.release(std::move(msg).release());
+}
+
+/// unpack_frames() in place: the payloads point into the slab, and keep it
+inline void unpack_frames(const std::shared_ptr<const recv_slab>& slab, size_t size,
+                          std::vector<wire_frame<slab_msg>>& out) {
+    for_each_packed_frame(slab->data(), size, [&](const wire_header& header, size_t offset) {
+        out.push_back({header, slab_msg(slab, offset, header.length)});
+    });
+}
+
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ib_bench {
+
+/**
+ * Layout of the 64-bit UCP tags of UCXBackend's traffic:
+ *
+ *   bits 56..63  message class (ucx_tag::msg_class)
+ *   bits 28..55  source rank, or ANY_SOURCE
+ *   bits  0..27  destination rank
+ *
+ * Receives match whole tags, so traffic that one receive takes from every
+ * rank (the data and control lanes) carries ANY_SOURCE, while traffic that
+ * is received from a known rank carries the real source.
+ *
+ * There is no channel field: the ucp wrapper's async_receive() and
+ * get_pending_size() take a whole tag and no mask, so a receive per channel
+ * would need one per channel and source, and batches mix channels anyway.
+ * The run() thread demultiplexes channels from the frame headers.
+ */
+namespace ucx_tag {
+
+enum class msg_class : uint64_t {
+    data = 0,     ///< batches and direct sends, into the receive ring
+    control = 1,  ///< the control lane
+    large = 2,    ///< announced messages larger than a receive slot
+    probe = 3     ///< startup probe, sent to self
+};
+
+constexpr unsigned CLASS_SHIFT = 56;
+constexpr unsigned SOURCE_SHIFT = 28;
+
+constexpr uint64_t RANK_MASK = (uint64_t(1) << SOURCE_SHIFT) - 1;
+constexpr uint64_t DEST_MASK = RANK_MASK;
+constexpr uint64_t SOURCE_MASK = RANK_MASK << SOURCE_SHIFT;
+
+/// Largest amount of ranks a tag can address, ANY_SOURCE excluded
+constexpr size_t MAX_RANKS = RANK_MASK;
+constexpr uint64_t ANY_SOURCE = RANK_MASK;
+
+constexpr uint64_t make(msg_class cls, uint64_t source, uint64_t dest) {
+    return (static_cast<uint64_t>(cls) << CLASS_SHIFT) |
+           ((source << SOURCE_SHIFT) & SOURCE_MASK) |
+           (dest & DEST_MASK);
+}
+
+static_assert(make(msg_class::large, 5, 7) ==
+              ((uint64_t(2) << CLASS_SHIFT) | (uint64_t(5) << SOURCE_SHIFT) | 7));
+
+}
+
+}
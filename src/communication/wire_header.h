@@ -0,0 +1,145 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <util/validate.h>
+
+namespace ib_bench {
+
+/**
+ * Fixed-size header of every communicator message on the wire.
+ * The header travels as a separate element next to the payload instead of
+ * being appended to it, so framing never reallocates or copies the payload,
+ * and a backend may send both with scatter/gather.
+ */
+struct alignas(8) wire_header {
+    uint8_t  type;      ///< Communicator message type
+    uint8_t  flags;     ///< Barrier messages: round, otherwise 0
+    uint16_t channel;   ///< Channel number
+    uint32_t source;    ///< Rank of the sending node
+    uint32_t length;    ///< Payload length in bytes
+    uint32_t sequence;  ///< Data messages: 0, the fences count them instead,
+                        ///< barrier messages: sync epoch,
+                        ///< fragments: length of the whole message
+
+    /// Boost.Serialization support (used by the MPI backend)
+    template <class Archive>
+    void serialize(Archive& ar, unsigned int) {
+        ar & type;
+        ar & flags;
+        ar & channel;
+        ar & source;
+        ar & length;
+        ar & sequence;
+    }
+};
+
+static_assert(sizeof(wire_header) == 16, "wire_header must stay 16 bytes");
+
+/// A single element of a scatter/gather list
+struct iov_element {
+    const void* base;
+    size_t length;
+};
+
+/**
+ * A header and a payload borrowed from the caller, valid only during the
+ * backend call it is passed to. Lets a part of a larger buffer be sent
+ * without first copying it into a frame of its own.
+ */
+struct wire_slice {
+    wire_header header;
+    const char* data;
+    size_t length;
+
+    /// The slice as a scatter/gather list: {header, payload}
+    std::array<iov_element, 2> iov() const {
+        return {{
+            {&header, sizeof(header)},
+            {data, length}
+        }};
+    }
+};
+
+/// A header and its untouched payload, as handed to and from the backends
+template <class Payload>
+struct wire_frame {
+    wire_header header;
+    Payload payload;
+
+    /// The frame as a wire_slice, valid as long as the frame
+    wire_slice slice() const {
+        return {header, payload.data(), payload.size()};
+    }
+
+    /// The frame as a scatter/gather list: {header, payload}
+    std::array<iov_element, 2> iov() const {
+        return {{
+            {&header, sizeof(header)},
+            {payload.data(), payload.size()}
+        }};
+    }
+
+    /// Boost.Serialization support (used by the MPI backend)
+    template <class Archive>
+    void serialize(Archive& ar, unsigned int) {
+        ar & header;
+        ar & payload;
+    }
+};
+
+/// Frames packed by pack_frame() start at multiples of this, so that a
+/// payload read in place from a batch is as aligned as a wire_header
+static constexpr size_t FRAME_ALIGN = alignof(wire_header);
+
+/// Bytes a frame with a payload of the given length takes in a packed batch
+constexpr size_t packed_size(size_t length) {
+    return sizeof(wire_header) + (length + FRAME_ALIGN - 1) / FRAME_ALIGN * FRAME_ALIGN;
+}
+
+/**
+ * Appends a frame to a batch of frames packed back to back, {header, payload},
+ * as the backends that send a destination's frames as a single byte buffer do.
+ * The payload is padded up to FRAME_ALIGN.
+ */
+template <class Buffer, class Frame>
+void pack_frame(Buffer& batch, const Frame& frame) {
+    for (auto [base, length] : frame.iov()) {
+        batch.append(static_cast<const char*>(base), length);
+    }
+    batch.append((FRAME_ALIGN - batch.size() % FRAME_ALIGN) % FRAME_ALIGN, '\0');
+}
+
+/**
+ * Goes over a batch of pack_frame(), and calls on_frame(header, offset) for
+ * each frame, with the offset of its payload in the batch.
+ */
+template <class OnFrame>
+void for_each_packed_frame(const char* data, size_t size, OnFrame&& on_frame) {
+    size_t offset = 0;
+    while (offset < size) {
+        VALIDATE(size - offset >= sizeof(wire_header), "Truncated batch of frames");
+        wire_header header;
+        std::memcpy(&header, data + offset, sizeof(wire_header));
+        offset += sizeof(wire_header);
+        VALIDATE(size - offset >= header.length, "Corrupted batch of frames");
+        on_frame(header, offset);
+        offset += packed_size(header.length) - sizeof(wire_header);
+    }
+}
+
+/// The inverse of pack_frame(): appends copies of the frames of a batch to out
+template <class Frame>
+void unpack_frames(const char* data, size_t size, std::vector<Frame>& out) {
+    for_each_packed_frame(data, size, [&](const wire_header& header, size_t offset) {
+        Frame frame;
+        frame.header = header;
+        frame.payload.assign(data + offset, header.length);
+        out.push_back(std::move(frame));
+    });
+}
+
+}
@@ -231,6 +231,11 @@ struct ucx_rt_ints {
         return m_data.data();
     }
 
+    template <class Archive>
+    void serialize(Archive& ar, unsigned int) {
+        ar & m_data;
+    }
+
 private:
     // [0]: rank
     // [1]: id
@@ -0,0 +1,106 @@
+#pragma once
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <iostream>
+#include <boost/format.hpp>
+#include "communication/communicator.h"
+#include "communication/backend_mpi.h"
+#include "util/accurate_timer.h"
+#include "data.h"
+
+namespace ib_bench {
+
+/// Measures the latency of a light channel while another channel is
+/// saturated. Rank 0 floods rank 1 with bulk messages on channel 0, and
+/// meanwhile ping-pongs small messages with it on channel 1. With equal
+/// weights the pings go out between bulk messages; raise bulk_weight to see
+/// them wait behind the bulk data.
+struct fair_sched_runner {
+    using comm_t = SRCommunicator<MPIBackend, ct_ints<65536>, ct_ints<2>>;
+
+    fair_sched_runner(
+        size_t pings,
+        size_t bulk_messages,
+        size_t bulk_weight,
+        const flush_config& flush
+    ) :
+        m_comm(flush),
+        m_pings(pings),
+        m_bulk_messages(bulk_messages)
+    {
+        m_comm.set_channel_weights({bulk_weight, 1});
+        // The run() thread consumes the bulk data, no receiver thread needed
+        m_comm.template set_receive_handler<0>([](auto&&) { });
+    }
+
+    void run() {
+        std::thread main_loop([this] { m_comm.run(); });
+        if (m_comm.size() < 2) {
+            std::cerr << "Test needs at least 2 ranks" << std::endl;
+        } else if (m_comm.rank() == 0) {
+            run_pinger();
+        } else if (m_comm.rank() == 1) {
+            run_ponger();
+        }
+        m_comm.mark_eof(0);
+        m_comm.mark_eof(1);
+        main_loop.join();
+    }
+
+private:
+    void run_pinger() {
+        generator<ct_ints<65536>> bulk_gen(m_comm.rank());
+        generator<ct_ints<2>> ping_gen(m_comm.rank());
+        std::thread flooder([&] {
+            for (size_t i = 0; i < m_bulk_messages; ++i) {
+                m_comm.template send<0>(bulk_gen(), 1);
+            }
+        });
+
+        std::vector<double> rtts;
+        rtts.reserve(m_pings);
+        for (size_t i = 0; i < m_pings; ++i) {
+            accurate_timer timer;
+            m_comm.template send<1>(ping_gen(), 1);
+            if (!m_comm.template receive<1>()) {
+                break;
+            }
+            rtts.push_back(timer.elapsed());
+        }
+        flooder.join();
+
+        if (rtts.empty()) {
+            return;
+        }
+        std::sort(rtts.begin(), rtts.end());
+        double sum = 0;
+        for (double rtt : rtts) {
+            sum += rtt;
+        }
+        std::cout << boost::format("%d pings: avg %.2f us, p50 %.2f us, "
+                                   "p99 %.2f us, max %.2f us")
+            % rtts.size()
+            % (sum * 1e6 / rtts.size())
+            % (rtts[rtts.size() / 2] * 1e6)
+            % (rtts[rtts.size() * 99 / 100] * 1e6)
+            % (rtts.back() * 1e6)
+            << std::endl;
+    }
+
+    void run_ponger() {
+        for (size_t i = 0; i < m_pings; ++i) {
+            auto ping = m_comm.template receive<1>();
+            if (!ping) {
+                break;
+            }
+            m_comm.template send<1>(*ping, 0);
+        }
+    }
+
+    comm_t m_comm;
+    size_t m_pings;
+    size_t m_bulk_messages;
+};
+
+}
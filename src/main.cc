@@ -11,50 +11,93 @@
 #include "ucx_2side_gap_runner.h"
 #include "ucx_1side_gap_runner.h"
 #include "bench2.h"
+#include "queue_rate_runner.h"
+#include "serialization_runner.h"
+#include "sync_latency_runner.h"
+#include "fair_sched_runner.h"
+#include "send_rate_runner.h"
 #include "ucx.h"
 #include <communicator.h>
 
 
 using namespace ib_bench;
 
+/// The channels of test 0
+template <class Backend>
+using bench0_runner = basic_channel_runner<
+    Backend,
+    ct_ints<2>,
+    ct_ints<8>,
+    ct_ints<16>,
+    ct_ints<64>,
+    ct_ints<1024>,
+    ct_ints<2048>
+>;
+
+template <class Backend>
 void bench0(
     size_t run_iters,
-    size_t flush_size,
+    const flush_config& flush,
     size_t sync_iters,
-    router::routing_table routing_table
+    router::routing_table routing_table,
+    receive_mode recv_mode
 ) {
-    return channel_runner<
-        ct_ints<2>,
-        ct_ints<8>,
-        ct_ints<16>,
-        ct_ints<64>,
-        ct_ints<1024>,
-        ct_ints<2048>
-    >{
+    return bench0_runner<Backend>{
         run_iters,
-        flush_size,
+        flush,
         sync_iters,
         {1, 2, 3, 2, 1, 0},
-        std::move(routing_table)
+        std::move(routing_table),
+        recv_mode
     }.run();
 }
 
+/// Test 0 with every rank a thread of this process
+void bench0_loopback(
+    size_t ranks,
+    size_t run_iters,
+    const flush_config& flush,
+    size_t sync_iters,
+    const router::routing_table& routing_table,
+    receive_mode recv_mode
+) {
+    loopback_world world(ranks);
+    std::vector<std::thread> threads;
+    for (size_t rank = 0; rank < ranks; ++rank) {
+        threads.emplace_back([&, rank] {
+            bench0_runner<LoopbackBackend>{
+                std::make_unique<LoopbackBackend>(world, rank, flush),
+                run_iters,
+                sync_iters,
+                {1, 2, 3, 2, 1, 0},
+                routing_table,
+                recv_mode
+            }.run();
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
 void gellers_communicator_ucx(
     ucp::communicator& comm,
     size_t run_iters,
-    size_t flush_size,
+    const flush_config& flush,
     size_t sync_iters,
-    router::routing_table routing_table
+    router::routing_table routing_table,
+    receive_mode recv_mode
 ) {
     return ucx_channel_runner<
         ct_ints<262144>
     >{
         comm,
         run_iters,
-        flush_size,
+        flush,
         sync_iters,
         {1},
-        std::move(routing_table)
+        std::move(routing_table),
+        recv_mode
     }.run();
 }
 
@@ -72,15 +115,74 @@ void bench4(size_t run_iters, int max_gap,router::routing_table routing_table, s
     all_to_all_gap_runner_shmem{run_iters, max_gap, std::move(routing_table), byte_count}.run();
 }
 
+/// "handler" selects receive handlers, anything else (or nothing) receive queues
+receive_mode parse_receive_mode(int argc, char** argv, int first) {
+    for (int i = first; i < argc; ++i) {
+        if (std::string(argv[i]) == "handler") {
+            return receive_mode::handler;
+        }
+    }
+    return receive_mode::queue;
+}
+
+/**
+ * flush_size is the message threshold. Options from argv[first] on:
+ * flush_bytes=N, flush_latency_us=N, adaptive, raw, send_slabs=N,
+ * thread_multiple, max_outstanding_bytes=N, direct_bytes=N, recv_slots=N,
+ * recv_slot_bytes=N and shmem_ring_bytes=N.
+ */
+flush_config parse_flush_config(int argc, char** argv, int first, size_t flush_size) {
+    flush_config config;
+    config.max_messages = flush_size;
+    for (int i = first; i < argc; ++i) {
+        std::string option = argv[i];
+        auto value = [&option] {
+            return strtoul(option.c_str() + option.find('=') + 1, nullptr, 10);
+        };
+        if (option.rfind("flush_bytes=", 0) == 0) {
+            config.max_bytes = value();
+        } else if (option.rfind("flush_latency_us=", 0) == 0) {
+            config.max_latency_sec = value() * 1e-6;
+        } else if (option == "adaptive") {
+            config.adaptive = true;
+        } else if (option == "raw") {
+            config.raw_mpi = true;
+        } else if (option.rfind("send_slabs=", 0) == 0) {
+            config.send_slabs = value();
+        } else if (option == "thread_multiple") {
+            config.thread_multiple = true;
+        } else if (option.rfind("max_outstanding_bytes=", 0) == 0) {
+            config.max_outstanding_bytes = value();
+        } else if (option.rfind("direct_bytes=", 0) == 0) {
+            config.direct_bytes = value();
+        } else if (option.rfind("recv_slots=", 0) == 0) {
+            config.recv_slots = value();
+        } else if (option.rfind("recv_slot_bytes=", 0) == 0) {
+            config.recv_slot_bytes = value();
+        } else if (option.rfind("shmem_ring_bytes=", 0) == 0) {
+            config.shmem_ring_bytes = value();
+        }
+    }
+    return config;
+}
+
 int main(int argc, char** argv) {
     using namespace std;
     if (argc == 1) {
-        cerr << "Use: ./test 0 run_iterations routing_table_file flush_size sync_iterations\n";
+        cerr << "Use: ./test 0 run_iterations routing_table_file flush_size sync_iterations [queue|handler] [flush_bytes=N] [flush_latency_us=N] [adaptive] [raw] [send_slabs=N] [thread_multiple] [max_outstanding_bytes=N]\n";
         cerr << "  or ./test 1 run_iterations routing_table_file max_gap packet_size\n";
         cerr << "  or ./test 2 run_iterations routing_table_file packet_size\n";
         cerr << "  or ./test 3 run_iterations min_packet_size max_packet_size\n";
         cerr << "  or (like 1, but shmem) ./test 4 run_iterations routing_table_file max_gap packet_size\n";
         cerr << "  or ./test 5 run_iterations routing_table_file max_gap\n";
+        cerr << "  or ./test 6 messages_per_thread sender_threads\n";
+        cerr << "  or ./test 7 iterations\n";
+        cerr << "  or ./test 8 sync_iterations\n";
+        cerr << "  or ./test 9 pings bulk_messages bulk_weight [flush_bytes=N] [flush_latency_us=N] [adaptive]\n";
+        cerr << "  or ./test 10 messages_per_thread max_sender_threads flush_size [flush_bytes=N] [flush_latency_us=N] [adaptive] [raw]\n";
+        cerr << "  or (like 0, but SHMEM) ./test 11 run_iterations routing_table_file flush_size sync_iterations [queue|handler] [flush_bytes=N] [flush_latency_us=N] [adaptive] [max_outstanding_bytes=N] [shmem_ring_bytes=N]\n";
+        cerr << "  or (like 0, ranks are threads of this process) ./test 12 run_iterations routing_table_file flush_size sync_iterations ranks [queue|handler] [flush_bytes=N] [flush_latency_us=N] [adaptive] [max_outstanding_bytes=N]\n";
+        cerr << "  or (like 0, but UCX) ./test 25 run_iterations routing_table_file flush_size sync_iterations [queue|handler] [flush_bytes=N] [flush_latency_us=N] [adaptive] [direct_bytes=N] [recv_slots=N] [recv_slot_bytes=N] [max_outstanding_bytes=N]\n";
         return -1;
     }
     char *end = nullptr;
@@ -89,16 +191,26 @@ int main(int argc, char** argv) {
     std::string routing_table_name;
     router::routing_table routing_table;
 
-    if (test_num != 2) {
+    if (test_num != 2 && argc > 3) {
         routing_table_name = argv[3];
         routing_table = load_routing_table(routing_table_name);
     }
+    if (test_num == 12) {
+        // no MPI nor UCX, the ranks only talk to each other
+        bench0_loopback(strtoul(argv[6], &end, 10), run_iters,
+                        parse_flush_config(argc, argv, 7, strtoul(argv[4], &end, 10)),
+                        strtoul(argv[5], &end, 10), routing_table, parse_receive_mode(argc, argv, 7));
+        return 0;
+    }
     namespace mpi = boost::mpi;
 
     size_t world_size = 2;
     auto var = std::getenv("OMPI_COMM_WORLD_SIZE");
     if (var) {
-      static mpi::environment env;
+      // Sender threads call MPI themselves with thread_multiple
+      bool thread_multiple = test_num == 10 ||
+          std::find(argv, argv + argc, std::string("thread_multiple")) != argv + argc;
+      static mpi::environment env(thread_multiple ? mpi::threading::multiple : mpi::threading::single);
       static mpi::communicator mpi_comm;
       world_size = mpi_comm.size();
     }
@@ -107,7 +219,7 @@ int main(int argc, char** argv) {
         ucp::create_world<ucp::oob::tcp_ip::connector>(world_size, false);
 
     switch (test_num) {
-        case 0: bench0(run_iters, strtoul(argv[4], &end, 10), strtoul(argv[5], &end, 10), std::move(routing_table)); break;
+        case 0: bench0<MPIBackend>(run_iters, parse_flush_config(argc, argv, 6, strtoul(argv[4], &end, 10)), strtoul(argv[5], &end, 10), std::move(routing_table), parse_receive_mode(argc, argv, 6)); break;
         case 1: bench1(run_iters, strtol(argv[4], &end, 10), std::move(routing_table), strtoul(argv[5], &end, 10)); break;
         case 2: bench1(run_iters, 1, std::move(routing_table), strtoul(argv[4], &end, 10)); break;
         case 3: {
@@ -118,6 +230,14 @@ int main(int argc, char** argv) {
         }
         case 4: bench4(run_iters, strtol(argv[4], &end, 10), std::move(routing_table), strtoul(argv[5], &end, 10)); break;
         case 5: bench5(run_iters, strtol(argv[4], &end, 10), std::move(routing_table)); break;
+        case 6: queue_rate_runner{run_iters, strtoul(argv[3], &end, 10)}.run(); break;
+        case 7: serialization_runner{run_iters}.run(); break;
+        case 8: sync_latency_runner{run_iters}.run(); break;
+        case 9: fair_sched_runner{run_iters, strtoul(argv[3], &end, 10), strtoul(argv[4], &end, 10),
+                                  parse_flush_config(argc, argv, 5, flush_config{}.max_messages)}.run(); break;
+        case 10: send_rate_runner{run_iters, strtoul(argv[3], &end, 10),
+                                  parse_flush_config(argc, argv, 5, strtoul(argv[4], &end, 10))}.run(); break;
+        case 11: bench0<ShmemBackend>(run_iters, parse_flush_config(argc, argv, 6, strtoul(argv[4], &end, 10)), strtoul(argv[5], &end, 10), std::move(routing_table), parse_receive_mode(argc, argv, 6)); break;
 
         case 21: {
             size_t min_packet_size = strtoul(argv[4], &end, 10);
@@ -144,9 +264,10 @@ int main(int argc, char** argv) {
             gellers_communicator_ucx(
                 comm, 
                 run_iters, 
-                strtoul(argv[4], &end, 10), 
+                parse_flush_config(argc, argv, 6, strtoul(argv[4], &end, 10)), 
                 strtoul(argv[5], &end, 10), 
-                std::move(routing_table)
+                std::move(routing_table),
+                parse_receive_mode(argc, argv, 6)
             ); 
             break;
         case 26: {
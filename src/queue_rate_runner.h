@@ -0,0 +1,87 @@
+#pragma once
+#include <thread>
+#include <vector>
+#include <iostream>
+#include <boost/format.hpp>
+#include "util/squeue.h"
+#include "util/mpsc_ring.h"
+#include "util/accurate_timer.h"
+#include "data.h"
+
+namespace ib_bench {
+
+/// Measures the message rate of the communicator's send queue alternatives.
+/// Several sender threads push messages shaped like the communicator's, while
+/// a single thread drains them in batches, as SRCommunicator::run() does.
+struct queue_rate_runner {
+
+    queue_rate_runner(size_t msgs_per_sender, size_t sender_threads) :
+        m_msgs_per_sender(msgs_per_sender),
+        m_sender_threads(sender_threads)
+    { }
+
+    void run() {
+        std::cout << "Send queue message rate, " << m_sender_threads <<
+            " sender threads, " << m_msgs_per_sender << " messages each" << std::endl;
+        run_packet<ct_ints<2>>("ct_ints<2>");
+        run_packet<ct_ints<8>>("ct_ints<8>");
+        run_packet<ct_ints<64>>("ct_ints<64>");
+    }
+
+private:
+    /// Mimics the communicator's SendMsgProp
+    struct queued_msg {
+        std::string data;
+        uint8_t msg_type;
+        size_t dest;
+    };
+
+    static constexpr size_t BATCH_SIZE = 256;
+
+    template <class Packet>
+    void run_packet(const char* name) {
+        double locked = measure<squeue<queued_msg>>(sizeof(Packet));
+        double lockfree = measure<mpsc_ring<queued_msg>>(sizeof(Packet));
+        std::cout << boost::format("%-12s squeue %8.3f Mmsg/s   mpsc_ring %8.3f Mmsg/s")
+            % name % (locked / 1e6) % (lockfree / 1e6) << std::endl;
+    }
+
+    /// @return messages per second
+    template <class Queue>
+    double measure(size_t msg_size) {
+        Queue queue;
+        const size_t total = m_msgs_per_sender * m_sender_threads;
+        accurate_timer timer;
+
+        std::vector<std::thread> senders;
+        for (size_t t = 0; t < m_sender_threads; ++t) {
+            senders.emplace_back([&queue, msg_size, t, this] {
+                for (size_t i = 0; i < m_msgs_per_sender; ++i) {
+                    queue.push({std::string(msg_size, 'a'), 0, t});
+                }
+            });
+        }
+
+        std::vector<queued_msg> batch;
+        batch.reserve(BATCH_SIZE);
+        size_t received = 0;
+        while (received < total) {
+            size_t popped = queue.try_pop_bulk(std::back_inserter(batch), BATCH_SIZE);
+            received += popped;
+            batch.clear();
+            if (!popped) {
+                std::this_thread::yield();
+            }
+        }
+        double elapsed = timer.elapsed();
+        for (auto& sender : senders) {
+            sender.join();
+        }
+        return total / elapsed;
+    }
+
+    size_t m_msgs_per_sender;
+    size_t m_sender_threads;
+};
+
+}
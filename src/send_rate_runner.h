@@ -0,0 +1,84 @@
+#pragma once
+#include <thread>
+#include <vector>
+#include <iostream>
+#include <boost/format.hpp>
+#include "communication/communicator.h"
+#include "communication/backend_mpi.h"
+#include "util/accurate_timer.h"
+#include "data.h"
+
+namespace ib_bench {
+
+/// Measures the communicator's message rate against the number of sender
+/// threads, with every message going through the run() thread's send queue,
+/// and with the sender threads sending through an MPI_THREAD_MULTIPLE
+/// backend themselves (flush_config::thread_multiple). Every rank floods the
+/// others with small messages, 1, 2, 4... up to max_sender_threads threads.
+/// MPI must be initialized with MPI_THREAD_MULTIPLE.
+struct send_rate_runner {
+    using packet_t = ct_ints<2>;
+    using comm_t = SRCommunicator<MPIBackend, packet_t>;
+
+    send_rate_runner(size_t msgs_per_sender, size_t max_sender_threads,
+                     const flush_config& flush) :
+        m_msgs_per_sender(msgs_per_sender),
+        m_max_sender_threads(max_sender_threads),
+        m_flush(flush)
+    { }
+
+    void run() {
+        flush_config direct = m_flush;
+        direct.thread_multiple = true;
+        for (size_t threads = 1; threads <= m_max_sender_threads; threads *= 2) {
+            double queued = measure(m_flush, threads);
+            double sent_direct = measure(direct, threads);
+            if (m_rank == 0) {
+                std::cout << boost::format("%3d sender threads: queued %8.3f Mmsg/s"
+                                           "   direct %8.3f Mmsg/s")
+                    % threads % (queued / 1e6) % (sent_direct / 1e6) << std::endl;
+            }
+        }
+    }
+
+private:
+    /// @return messages per second sent by this rank, until the channel closed
+    double measure(const flush_config& flush, size_t sender_threads) {
+        comm_t comm(flush);
+        m_rank = comm.rank();
+        if (comm.size() < 2) {
+            std::cerr << "Test needs at least 2 ranks" << std::endl;
+            return 0;
+        }
+        // The run() thread consumes the messages, no receiver thread needed
+        comm.template set_receive_handler<0>([](auto&&) { });
+
+        accurate_timer timer;
+        std::thread main_loop([&comm] { comm.run(); });
+        std::vector<std::thread> senders;
+        for (size_t t = 0; t < sender_threads; ++t) {
+            senders.emplace_back([&comm, t, this] {
+                generator<packet_t> gen(comm.rank());
+                size_t others = comm.size() - 1;
+                for (size_t i = 0; i < m_msgs_per_sender; ++i) {
+                    size_t dest = (comm.rank() + 1 + (t + i) % others) % comm.size();
+                    comm.template send<0>(gen(i), dest);
+                }
+            });
+        }
+        for (auto& sender : senders) {
+            sender.join();
+        }
+        comm.mark_eof(0);
+        main_loop.join();
+        double elapsed = timer.elapsed();
+        return m_msgs_per_sender * sender_threads / elapsed;
+    }
+
+    size_t m_msgs_per_sender;
+    size_t m_max_sender_threads;
+    flush_config m_flush;
+    size_t m_rank = 0;
+};
+
+}
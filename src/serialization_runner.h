@@ -0,0 +1,106 @@
+#pragma once
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <boost/format.hpp>
+#include <cereal/types/array.hpp>
+#include "util/serialization.h"
+#include "util/buffer_pool.h"
+#include "util/accurate_timer.h"
+#include "data.h"
+
+namespace ib_bench {
+
+/// Serialization micro-benchmark over the data.h packet types. Compares the
+/// stream based path (ostringstream/istringstream), the buffer archives with
+/// pooled buffers, and the raw memcpy path for trivially copyable packets.
+/// shmem_rt_ints is not covered, since it lives on the symmetric heap.
+struct serialization_runner {
+
+    explicit serialization_runner(size_t iterations) : m_iterations(iterations)
+    { }
+
+    void run() {
+        std::cout << "Serialization round trip, ns per packet, " <<
+            m_iterations << " iterations" << std::endl;
+        std::cout << boost::format("%-24s %10s %10s %10s %10s")
+            % "packet" % "bytes" % "stream" % "buffer" % "raw" << std::endl;
+        run_packet("ct_ints<2>", generator<ct_ints<2>>(0)());
+        run_packet("ct_ints<8>", generator<ct_ints<8>>(0)());
+        run_packet("ct_ints<64>", generator<ct_ints<64>>(0)());
+        run_packet("ct_ints<2048>", generator<ct_ints<2048>>(0)());
+        run_packet("ct_ints<64, cereal>", generator<ct_ints<64, false>>(0)());
+        run_packet("rt_ints(64)", generator<rt_ints<>>(0, 64)());
+        run_packet("rt_ints(2048)", generator<rt_ints<>>(0, 2048)());
+        run_packet("ucx_rt_ints(64)", generator<ucx_rt_ints>(0, 64)());
+        run_packet("ucx_rt_ints(2048)", generator<ucx_rt_ints>(0, 2048)());
+    }
+
+private:
+    template <class Packet>
+    void run_packet(const char* name, const Packet& packet) {
+        size_t bytes = util::serialize(packet).size();
+        double stream = measure_stream(packet);
+        double buffer = measure_buffer(packet);
+        auto fmt = boost::format("%-24s %10d %10.1f %10.1f %10s")
+            % name % bytes % stream % buffer;
+        if constexpr (util::is_raw_serializable_v<Packet>) {
+            fmt % (boost::format("%.1f") % measure_raw(packet)).str();
+        } else {
+            fmt % "-";
+        }
+        std::cout << fmt << std::endl;
+    }
+
+    /// @return ns per round trip
+    template <class Packet>
+    double measure_stream(const Packet& packet) {
+        accurate_timer timer;
+        for (size_t i = 0; i < m_iterations; ++i) {
+            std::ostringstream os;
+            util::serialize(packet, os);
+            std::istringstream is(os.str());
+            consume(util::deserialize<Packet>(is));
+        }
+        return timer.elapsed() * 1e9 / m_iterations;
+    }
+
+    template <class Packet>
+    double measure_buffer(const Packet& packet) {
+        accurate_timer timer;
+        for (size_t i = 0; i < m_iterations; ++i) {
+            std::string buffer = m_pool.acquire();
+            util::serialize(packet, buffer);
+            consume(util::deserialize<Packet>(std::string_view(buffer)));
+            m_pool.release(std::move(buffer));
+        }
+        return timer.elapsed() * 1e9 / m_iterations;
+    }
+
+    template <class Packet>
+    double measure_raw(const Packet& packet) {
+        accurate_timer timer;
+        for (size_t i = 0; i < m_iterations; ++i) {
+            std::string buffer = m_pool.acquire();
+            buffer.assign(reinterpret_cast<const char*>(&packet), sizeof(packet));
+            Packet copy;
+            std::memcpy(&copy, buffer.data(), sizeof(copy));
+            consume(copy);
+            m_pool.release(std::move(buffer));
+        }
+        return timer.elapsed() * 1e9 / m_iterations;
+    }
+
+    /// Keeps the compiler from optimizing the round trip away
+    template <class Packet>
+    void consume(const Packet& packet) {
+        m_sink = m_sink + packet.size();
+    }
+
+    size_t m_iterations;
+    buffer_pool<std::string> m_pool;
+    volatile size_t m_sink = 0;
+};
+
+}
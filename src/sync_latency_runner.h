@@ -0,0 +1,53 @@
+#pragma once
+#include <thread>
+#include <iostream>
+#include <boost/format.hpp>
+#include "communication/communicator.h"
+#include "communication/backend_mpi.h"
+#include "util/accurate_timer.h"
+#include "data.h"
+
+namespace ib_bench {
+
+/// Measures the latency of SRCommunicator::synchronize() over MPI. Every
+/// iteration sends one packet to the next rank, so the sync includes a fence,
+/// and then synchronizes. Run with different amounts of ranks to see how the
+/// latency scales.
+struct sync_latency_runner {
+    using comm_t = SRCommunicator<MPIBackend, ct_ints<2>>;
+
+    explicit sync_latency_runner(size_t iterations) : m_iterations(iterations)
+    {
+        // The run() thread consumes the packets, no receiver thread needed
+        m_comm.template set_receive_handler<0>([](auto&&) { });
+    }
+
+    void run() {
+        std::thread main_loop([this] { m_comm.run(); });
+        size_t next = (m_comm.rank() + 1) % m_comm.size();
+        generator<ct_ints<2>> gen(m_comm.rank());
+
+        // warm up, and start measuring with all ranks in sync
+        m_comm.template synchronize<0>();
+        accurate_timer timer;
+        for (size_t i = 0; i < m_iterations; ++i) {
+            m_comm.template send<0>(gen(), next);
+            m_comm.template synchronize<0>();
+        }
+        double elapsed = timer.elapsed();
+        m_comm.mark_eof(0);
+        main_loop.join();
+
+        if (m_comm.rank() == 0) {
+            std::cout << boost::format("%d ranks, %d syncs, %.2f us per sync")
+                % m_comm.size() % m_iterations % (elapsed * 1e6 / m_iterations)
+                << std::endl;
+        }
+    }
+
+private:
+    comm_t m_comm;
+    size_t m_iterations;
+};
+
+}
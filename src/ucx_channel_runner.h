@@ -16,28 +16,48 @@ template <class... ChannelTypes>
 struct ucx_channel_runner {
 
     using channel_priorities = std::array<size_t, sizeof...(ChannelTypes)>;
+    using comm_t = SRCommunicator<UCXBackend, ChannelTypes...>;
+    /// Max messages received from a channel at once
+    static constexpr size_t RECV_BATCH_SIZE = 64;
 
     ucx_channel_runner(
         ucp::communicator& comm,
         size_t iters_to_run,
-        size_t flush_size,
+        const flush_config& flush,
         size_t iters_to_sync,
         const channel_priorities& channel_priorities,
-        router::routing_table routing_table
+        router::routing_table routing_table,
+        receive_mode recv_mode = receive_mode::queue
     ) :
-        m_comm(comm, flush_size),
+        m_comm(comm, flush),
         m_comm_size(m_comm.size()),
         m_iters_to_run(iters_to_run),
         m_iters_to_sync(iters_to_sync),
         m_channel_priorities(channel_priorities),
-        m_router((size_t)m_comm.size(), (size_t)m_comm.rank(), std::move(routing_table))
+        m_router((size_t)m_comm.size(), (size_t)m_comm.rank(), std::move(routing_table)),
+        m_recv_mode(recv_mode)
     {
         std::srand(0);
+        // a channel that generates more messages gets a bigger share of the send path
+        std::array<size_t, sizeof...(ChannelTypes)> weights;
+        for (size_t i = 0; i < weights.size(); ++i) {
+            weights[i] = 1 + m_channel_priorities[i];
+        }
+        m_comm.set_channel_weights(weights);
+        if (m_recv_mode == receive_mode::handler) {
+            set_receive_handlers();
+        }
     }
 
+    // all channels synchronize concurrently
     void sync() {
         auto per_channel = [=]<size_t... Is>(std::index_sequence<Is...>) {
-            (..., m_comm.template synchronize<Is>());
+            std::array<sync_handle, sizeof...(Is)> handles = {
+                m_comm.template begin_synchronize<Is>()...
+            };
+            for (auto& handle : handles) {
+                m_comm.wait_synchronize(handle);
+            }
         };
         per_channel(std::index_sequence_for<ChannelTypes...>{});
     }
@@ -70,9 +90,27 @@ struct ucx_channel_runner {
         per_channel(std::index_sequence_for<ChannelTypes...>{});
     }
 
+    // the payload is only dropped, so views save deserializing it. Draining
+    // in batches locks the receive queue once per batch.
     template <size_t PORT, typename T>
     void receive_channel() {
-        m_comm.template try_receive<PORT>();
+        thread_local std::vector<typename comm_t::template view_t<PORT>> views;
+        m_comm.template try_receive_view_bulk<PORT>(std::back_inserter(views),
+                                                    RECV_BATCH_SIZE);
+        for (auto& view : views) {
+            m_stats.update_received(view.bytes().size());
+        }
+        views.clear();
+    }
+
+    // receive_mode::handler - the communicator's loop drops the payloads
+    void set_receive_handlers() {
+        auto per_channel = [=]<size_t... Is>(std::index_sequence<Is...>) {
+            (..., m_comm.template set_receive_handler<Is>([this](auto&& view) {
+                m_stats.update_received(view.bytes().size());
+            }));
+        };
+        per_channel(std::index_sequence_for<ChannelTypes...>{});
     }
 
     void receive() {
@@ -104,8 +142,9 @@ struct ucx_channel_runner {
         };
 
         auto receive = [&]() {
-            while (!m_stopped) {
+            while (!m_stopped && m_recv_mode == receive_mode::queue) {
                 this->receive();
+                m_comm.wait_recv();
             }
             BENCH_LOG_DEBUG(boost::format("[%d] recv exit") % m_comm.rank());
         };
@@ -120,16 +159,20 @@ struct ucx_channel_runner {
         receiver.join();
         std::cout << "Rank " << m_comm.rank() << " sent " << (m_stats.bytes_sent() / 1024 / 1024) <<
             " MB " << m_stats.seconds_passed() << " sec " << (m_stats.upstream_bandwidth() * 8 / (1 << 20)) << " Mbit/s" << std::endl;
+        std::cout << "Rank " << m_comm.rank() << " received " << m_stats.msgs_received() <<
+            " msgs " << (m_stats.downstream_msg_rate() / 1e6) << " Mmsg/s (" <<
+            (m_recv_mode == receive_mode::queue ? "queue" : "handler") << " mode)" << std::endl;
     }
 
 private:
-    SRCommunicator<UCXBackend, ChannelTypes...> m_comm;
+    comm_t m_comm;
     size_t m_comm_size;
     size_t m_iters_to_run;
     size_t m_iters_to_sync;
     std::atomic_bool m_stopped;
     channel_priorities m_channel_priorities;
     router m_router;
+    receive_mode m_recv_mode;
     NetStats m_stats;
 };
 
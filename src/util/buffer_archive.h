@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include <cereal/cereal.hpp>
+
+namespace util {
+
+/**
+ * A cereal binary output archive that appends to a caller-supplied buffer,
+ * growing it as needed. Unlike cereal::BinaryOutputArchive it needs no
+ * std::ostream, so serializing into a reused buffer allocates nothing once
+ * the buffer's capacity suffices. Produces the same bytes as
+ * cereal::BinaryOutputArchive.
+ */
+class BufferOutputArchive :
+    public cereal::OutputArchive<BufferOutputArchive, cereal::AllowEmptyClassElision> {
+public:
+    explicit BufferOutputArchive(std::string& buffer) :
+        cereal::OutputArchive<BufferOutputArchive, cereal::AllowEmptyClassElision>(this),
+        m_buffer(buffer)
+    { }
+
+    void saveBinary(const void* data, std::streamsize size) {
+        m_buffer.append(static_cast<const char*>(data), size);
+    }
+
+private:
+    std::string& m_buffer;
+};
+
+/**
+ * A cereal binary input archive that reads directly from a memory range,
+ * without an std::istream. Reads what cereal::BinaryOutputArchive (or
+ * BufferOutputArchive) wrote.
+ */
+class BufferInputArchive :
+    public cereal::InputArchive<BufferInputArchive, cereal::AllowEmptyClassElision> {
+public:
+    explicit BufferInputArchive(std::string_view buffer) :
+        cereal::InputArchive<BufferInputArchive, cereal::AllowEmptyClassElision>(this),
+        m_buffer(buffer)
+    { }
+
+    void loadBinary(void* const data, std::streamsize size) {
+        if (static_cast<size_t>(size) > m_buffer.size()) {
+            throw cereal::Exception(
+                "Failed to read " + std::to_string(size) + " bytes from buffer! "
+                "Only " + std::to_string(m_buffer.size()) + " left");
+        }
+        std::memcpy(data, m_buffer.data(), size);
+        m_buffer.remove_prefix(size);
+    }
+
+    /// Number of bytes not read yet
+    size_t remaining() const {
+        return m_buffer.size();
+    }
+
+private:
+    std::string_view m_buffer;
+};
+
+// The same serialization functions cereal provides for its binary archives
+
+template <class T>
+std::enable_if_t<std::is_arithmetic<T>::value>
+CEREAL_SAVE_FUNCTION_NAME(BufferOutputArchive& ar, const T& t) {
+    ar.saveBinary(std::addressof(t), sizeof(t));
+}
+
+template <class T>
+std::enable_if_t<std::is_arithmetic<T>::value>
+CEREAL_LOAD_FUNCTION_NAME(BufferInputArchive& ar, T& t) {
+    ar.loadBinary(std::addressof(t), sizeof(t));
+}
+
+template <class Archive, class T>
+CEREAL_ARCHIVE_RESTRICT(BufferInputArchive, BufferOutputArchive)
+CEREAL_SERIALIZE_FUNCTION_NAME(Archive& ar, cereal::NameValuePair<T>& t) {
+    ar(t.value);
+}
+
+template <class Archive, class T>
+CEREAL_ARCHIVE_RESTRICT(BufferInputArchive, BufferOutputArchive)
+CEREAL_SERIALIZE_FUNCTION_NAME(Archive& ar, cereal::SizeTag<T>& t) {
+    ar(t.size);
+}
+
+template <class T>
+void CEREAL_SAVE_FUNCTION_NAME(BufferOutputArchive& ar, const cereal::BinaryData<T>& bd) {
+    ar.saveBinary(bd.data, static_cast<std::streamsize>(bd.size));
+}
+
+template <class T>
+void CEREAL_LOAD_FUNCTION_NAME(BufferInputArchive& ar, cereal::BinaryData<T>& bd) {
+    ar.loadBinary(bd.data, static_cast<std::streamsize>(bd.size));
+}
+
+} // namespace util
+
+CEREAL_REGISTER_ARCHIVE(util::BufferOutputArchive)
+CEREAL_REGISTER_ARCHIVE(util::BufferInputArchive)
+CEREAL_SETUP_ARCHIVE_TRAITS(util::BufferInputArchive, util::BufferOutputArchive)
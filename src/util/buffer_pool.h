@@ -0,0 +1,109 @@
+#pragma once
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace ib_bench {
+
+/**
+ * A thread-safe pool of reusable byte buffers (std::string or any
+ * container with clear(), capacity() and reserve()).
+ *
+ * acquire() hands out an empty buffer which keeps the capacity it had when
+ * it was released, so buffers filled over and over reach a steady state
+ * with no allocations. The pool itself is bounded, by the amount of buffers
+ * and by the capacity they hold together: buffers released to a full pool,
+ * or buffers grown beyond max_capacity, are simply freed.
+ */
+template <class Buffer = std::string>
+class buffer_pool {
+public:
+    static constexpr size_t DEFAULT_MAX_BUFFERS = 4096;
+    static constexpr size_t DEFAULT_MAX_CAPACITY = 1 << 20;
+    static constexpr size_t DEFAULT_MAX_BYTES = 16 << 20;
+
+    /**
+     * @param max_buffers Buffers kept at most
+     * @param max_capacity Larger buffers are not kept
+     * @param max_bytes Capacity of all kept buffers together, at most
+     */
+    explicit buffer_pool(size_t max_buffers = DEFAULT_MAX_BUFFERS,
+                         size_t max_capacity = DEFAULT_MAX_CAPACITY,
+                         size_t max_bytes = DEFAULT_MAX_BYTES) :
+        m_max_buffers(max_buffers),
+        m_max_capacity(max_capacity),
+        m_max_bytes(max_bytes)
+    {
+        m_free.reserve(m_max_buffers);
+    }
+
+    buffer_pool(const buffer_pool&) = delete;
+    buffer_pool& operator=(const buffer_pool&) = delete;
+
+    /// @return An empty buffer, recycled if possible
+    Buffer acquire() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_free.empty()) {
+            return Buffer();
+        }
+        Buffer rv = std::move(m_free.back());
+        m_free.pop_back();
+        m_bytes -= rv.capacity();
+        return rv;
+    }
+
+    /// @return An empty buffer with at least the given capacity
+    Buffer acquire(size_t capacity) {
+        Buffer rv = acquire();
+        rv.reserve(capacity);
+        return rv;
+    }
+
+    /// Returns a buffer to the pool. Its content is discarded.
+    void release(Buffer&& buffer) {
+        // nothing worth keeping in an unallocated (or small-string) buffer
+        if (buffer.capacity() <= Buffer().capacity() ||
+            buffer.capacity() > m_max_capacity) {
+            return;
+        }
+        buffer.clear();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_free.size() < m_max_buffers &&
+            m_bytes + buffer.capacity() <= m_max_bytes) {
+            m_bytes += buffer.capacity();
+            m_free.push_back(std::move(buffer));
+        }
+    }
+
+    /// Number of buffers currently waiting in the pool
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_free.size();
+    }
+
+    /// Capacity of the buffers currently waiting in the pool
+    size_t bytes() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_bytes;
+    }
+
+private:
+    size_t m_max_buffers;
+    size_t m_max_capacity;
+    size_t m_max_bytes;
+    /// Capacity of the buffers in m_free
+    size_t m_bytes = 0;
+    mutable std::mutex m_mutex;
+    std::vector<Buffer> m_free;
+};
+
+/**
+ * Returns a received payload to the pool its buffer came from. Overloaded
+ * for the payload types that are not themselves pooled buffers.
+ */
+template <class Buffer>
+void recycle(buffer_pool<Buffer>& pool, Buffer&& buffer) {
+    pool.release(std::move(buffer));
+}
+
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace ib_bench {
+
+/**
+ * An eventcount: lets a thread sleep until some condition, which is
+ * published elsewhere, may have changed, without missing a wakeup.
+ *
+ * Waiter:
+ *   auto key = ec.prepare_wait();
+ *   if (condition) { ec.cancel_wait(); } else { ec.wait(key, spins); }
+ *
+ * Notifier: make the condition true, then call notify_all().
+ *
+ * notify_all() is a single atomic increment while nobody waits, and takes the
+ * mutex only to wake sleeping waiters. wait() spins for a while before
+ * parking on the condition variable, so short waits don't pay for a sleep.
+ */
+class event_count {
+public:
+    using key_t = uint64_t;
+
+    event_count() = default;
+    event_count(const event_count&) = delete;
+    event_count& operator=(const event_count&) = delete;
+
+    /// Registers as a waiter. Check the condition after calling this.
+    key_t prepare_wait() {
+        m_waiters.fetch_add(1, std::memory_order_seq_cst);
+        return m_epoch.load(std::memory_order_seq_cst);
+    }
+
+    /// Unregisters a waiter whose condition turned out true
+    void cancel_wait() {
+        m_waiters.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    /**
+     * Blocks until notify_all() is called after prepare_wait() returned key.
+     * Polls up to spin_count times before going to sleep.
+     */
+    void wait(key_t key, size_t spin_count) {
+        for (size_t i = 0; i < spin_count; ++i) {
+            if (m_epoch.load(std::memory_order_acquire) != key) {
+                cancel_wait();
+                return;
+            }
+            cpu_relax();
+        }
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (m_epoch.load(std::memory_order_acquire) == key) {
+                m_cond.wait(lock);
+            }
+        }
+        cancel_wait();
+    }
+
+    /// Wakes all current waiters
+    void notify_all() {
+        m_epoch.fetch_add(1, std::memory_order_seq_cst);
+        if (m_waiters.load(std::memory_order_seq_cst) != 0) {
+            // Taking the lock orders this with a waiter that is between
+            // checking the epoch and sleeping
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_cond.notify_all();
+        }
+    }
+
+private:
+    static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+    std::atomic<key_t> m_epoch{0};
+    std::atomic<size_t> m_waiters{0};
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+};
+
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+#include <boost/optional.hpp>
+
+#include "squeue.h"
+
+namespace ib_bench {
+
+/**
+ * A bounded, lock-free, multi-producer single-consumer ring.
+ * Each cell carries a sequence number which tells producers and the consumer
+ * whether the cell is free or holds a published element (D. Vyukov's bounded
+ * queue). Producers only contend on a CAS of the tail, and the consumer never
+ * takes a lock.
+ *
+ * Provides the subset of the squeue interface used by the communicator's
+ * send side, so the two are interchangeable as a send queue.
+ *
+ * @tparam T The type to hold in the ring.
+ *
+ * @note Only a single thread may pop from the ring at a time.
+ */
+template <typename T>
+class mpsc_ring {
+public:
+    /// Held elements' type.
+    using value_type = T;
+
+    static constexpr size_t DEFAULT_CAPACITY = 1 << 14;
+
+    /// @param capacity Amount of cells, rounded up to a power of 2
+    explicit mpsc_ring(size_t capacity = DEFAULT_CAPACITY);
+    ~mpsc_ring();
+    mpsc_ring(const mpsc_ring&) = delete;
+    mpsc_ring(mpsc_ring&&) = delete;
+    mpsc_ring& operator=(const mpsc_ring&) = delete;
+    mpsc_ring& operator=(mpsc_ring&&) = delete;
+
+    /**
+     * Push an object to the ring. If the ring is full, yields until the
+     * consumer frees a cell (backpressure).
+     * Throws squeue_eof if the ring was marked eof.
+     */
+    void push(T obj);
+
+    /// Push an object if there's a free cell. Does not block.
+    bool try_push(T& obj);
+
+    /// Pops an object if one was published, does not block.
+    boost::optional<T> try_pop();
+
+    /**
+     * Pops up to max_count published objects into out.
+     * Meant for the consumer to drain the ring in batches.
+     *
+     * @return The number of popped objects.
+     */
+    template <typename OutputIt>
+    size_t try_pop_bulk(OutputIt out, size_t max_count);
+
+    /// Number of elements in the ring. Approximate while pushes are in flight.
+    size_t size() const;
+
+    bool empty() const;
+
+    /// Marks the ring as eof. Further pushes throw squeue_eof.
+    void mark_eof();
+
+    bool eof() const;
+
+    size_t capacity() const;
+
+private:
+    static constexpr size_t CACHE_LINE = 64;
+
+    struct cell {
+        std::atomic<size_t> sequence;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    T* value_ptr(cell& c);
+
+    /// Pops the element at the head, assuming it was published
+    T inner_pop(cell& c);
+
+    size_t m_mask;
+    std::unique_ptr<cell[]> m_cells;
+    /** Next position to push to. Shared by all producers. */
+    alignas(CACHE_LINE) std::atomic<size_t> m_tail;
+    /** Next position to pop from. Owned by the consumer. */
+    alignas(CACHE_LINE) std::atomic<size_t> m_head;
+    alignas(CACHE_LINE) std::atomic<bool> m_eof;
+};
+
+}
+
+#define __WITHIN_MPSC_RING_H__
+#include "mpsc_ring.inl"
+#undef __WITHIN_MPSC_RING_H__
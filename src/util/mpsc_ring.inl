@@ -0,0 +1,151 @@
+
+#ifndef __WITHIN_MPSC_RING_H__
+#error "Do not directly include this file."
+#endif
+
+#include <thread>
+
+namespace ib_bench {
+
+namespace detail {
+
+inline size_t round_up_to_power_of_2(size_t n) {
+    size_t rv = 1;
+    while (rv < n) {
+        rv <<= 1;
+    }
+    return rv;
+}
+
+}
+
+template <typename T>
+mpsc_ring<T>::mpsc_ring(size_t capacity) :
+    m_mask(detail::round_up_to_power_of_2(std::max<size_t>(capacity, 2)) - 1),
+    m_cells(new cell[m_mask + 1]),
+    m_tail(0),
+    m_head(0),
+    m_eof(false)
+{
+    for (size_t i = 0; i <= m_mask; ++i) {
+        m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+template <typename T>
+mpsc_ring<T>::~mpsc_ring() {
+    while (try_pop()) { }
+}
+
+template <typename T>
+void mpsc_ring<T>::push(T obj) {
+    while (true) {
+        if (m_eof.load(std::memory_order_relaxed)) {
+            throw squeue_eof();
+        }
+        if (try_push(obj)) {
+            return;
+        }
+        // full, let the consumer catch up
+        std::this_thread::yield();
+    }
+}
+
+template <typename T>
+bool mpsc_ring<T>::try_push(T& obj) {
+    size_t pos = m_tail.load(std::memory_order_relaxed);
+    cell* c;
+    while (true) {
+        c = &m_cells[pos & m_mask];
+        size_t seq = c->sequence.load(std::memory_order_acquire);
+        auto diff = static_cast<std::ptrdiff_t>(seq - pos);
+        if (diff == 0) {
+            // the cell is free, try to claim it
+            if (m_tail.compare_exchange_weak(
+                    pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // the cell still holds an element from the previous lap
+            return false;
+        } else {
+            // another producer claimed the cell
+            pos = m_tail.load(std::memory_order_relaxed);
+        }
+    }
+    new (&c->storage) T(std::move(obj));
+    // publish
+    c->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+template <typename T>
+boost::optional<T> mpsc_ring<T>::try_pop() {
+    size_t pos = m_head.load(std::memory_order_relaxed);
+    cell& c = m_cells[pos & m_mask];
+    if (c.sequence.load(std::memory_order_acquire) != pos + 1) {
+        return boost::none;
+    }
+    return inner_pop(c);
+}
+
+template <typename T>
+template <typename OutputIt>
+size_t mpsc_ring<T>::try_pop_bulk(OutputIt out, size_t max_count) {
+    size_t pos = m_head.load(std::memory_order_relaxed);
+    size_t popped = 0;
+    for (; popped < max_count; ++popped, ++pos) {
+        cell& c = m_cells[pos & m_mask];
+        if (c.sequence.load(std::memory_order_acquire) != pos + 1) {
+            break;
+        }
+        *out++ = inner_pop(c);
+    }
+    return popped;
+}
+
+template <typename T>
+size_t mpsc_ring<T>::size() const {
+    size_t head = m_head.load(std::memory_order_relaxed);
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+template <typename T>
+bool mpsc_ring<T>::empty() const {
+    return size() == 0;
+}
+
+template <typename T>
+void mpsc_ring<T>::mark_eof() {
+    m_eof.store(true, std::memory_order_release);
+}
+
+template <typename T>
+bool mpsc_ring<T>::eof() const {
+    return m_eof.load(std::memory_order_acquire);
+}
+
+template <typename T>
+size_t mpsc_ring<T>::capacity() const {
+    return m_mask + 1;
+}
+
+template <typename T>
+T* mpsc_ring<T>::value_ptr(cell& c) {
+    return std::launder(reinterpret_cast<T*>(&c.storage));
+}
+
+template <typename T>
+T mpsc_ring<T>::inner_pop(cell& c) {
+    size_t pos = m_head.load(std::memory_order_relaxed);
+    T* ptr = value_ptr(c);
+    T ret = std::move(*ptr);
+    ptr->~T();
+    // free the cell for the producers' next lap
+    c.sequence.store(pos + m_mask + 1, std::memory_order_release);
+    m_head.store(pos + 1, std::memory_order_relaxed);
+    return ret;
+}
+
+}
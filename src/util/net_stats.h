@@ -11,6 +11,8 @@ struct NetStats {
 
     size_t bytes_received() const { return m_bytes_received;}
 
+    size_t msgs_received()  const { return m_msgs_received; }
+
     double seconds_passed() const { return m_timer.elapsed_seconds(); }
 
     void finish() {
@@ -20,6 +22,7 @@ struct NetStats {
 
     void update_received(size_t num_bytes) {
         m_bytes_received += num_bytes;
+        ++m_msgs_received;
     }
 
     void update_sent(size_t num_bytes) {
@@ -34,9 +37,14 @@ struct NetStats {
         return (double)(m_bytes_received) / m_timer.elapsed_seconds();
     }
 
+    double downstream_msg_rate() const {
+        return (double)(m_msgs_received) / m_timer.elapsed_seconds();
+    }
+
 private:
     bool   m_running        = true;
     Timer  m_timer;
     size_t m_bytes_sent     = 0;
     size_t m_bytes_received = 0;
+    size_t m_msgs_received  = 0;
 };
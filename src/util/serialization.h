@@ -1,6 +1,8 @@
 #pragma once
 
 #include <sstream>
+#include <string_view>
+#include <type_traits>
 #include <tuple>
 #include <variant>
 #include <filesystem>
@@ -16,6 +18,8 @@
 #include <cereal/types/utility.hpp>
 #include <cereal/types/vector.hpp>
 
+#include "buffer_archive.h"
+
 namespace cereal {
 
     template <class Archive, class ...Ts>
@@ -46,6 +50,20 @@ namespace cereal {
 
 namespace util {
     namespace fs = std::filesystem;
+
+    /**
+     * Types which may be sent as their raw object representation (memcpy)
+     * instead of going through cereal. Only valid between processes that
+     * share the same executable. Defaults to trivially copyable types;
+     * specialize to std::false_type for types holding pointers or handles.
+     */
+    template <class T>
+    struct is_raw_serializable : std::is_trivially_copyable<T> {};
+
+    template <class T>
+    constexpr bool is_raw_serializable_v =
+        is_raw_serializable<std::decay_t<T>>::value;
+
     template <class T>
     void serialize(T&& value, std::ostream& os) {
         cereal::BinaryOutputArchive(os) << std::forward<T>(value);
@@ -57,11 +75,17 @@ namespace util {
         serialize(std::forward<T>(value), ofstream);
     }
 
+    /// Appends the serialized value to buffer, with no intermediate stream
+    template <class T>
+    void serialize(T&& value, std::string& buffer) {
+        BufferOutputArchive(buffer) << std::forward<T>(value);
+    }
+
     template <class T>
     std::string serialize(T&& value) {
-        std::ostringstream os;
-        serialize(std::forward<T>(value), os);
-        return os.str();
+        std::string buffer;
+        serialize(std::forward<T>(value), buffer);
+        return buffer;
     }
 
     template <class T>
@@ -78,10 +102,26 @@ namespace util {
         return deserialize<T>(ifstream);
     }
 
+    /**
+     * Reads the value directly from the buffer, with no intermediate stream,
+     * into an existing object. Containers in it keep their capacity.
+     */
+    template <class T>
+    void deserialize(std::string_view buffer, T& value) {
+        BufferInputArchive archive(buffer);
+        archive >> value;
+    }
+
+    template <class T>
+    T deserialize(std::string_view buffer) {
+        T rv;
+        deserialize(buffer, rv);
+        return rv;
+    }
+
     template <class T>
     T deserialize(const std::string& s) {
-        std::istringstream is(s);
-        return deserialize<T>(is);
+        return deserialize<T>(std::string_view(s));
     }
 
 } // namespace town::util
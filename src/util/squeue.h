@@ -65,6 +65,17 @@ struct squeue {
      */
     boost::optional<T> try_pop();
 
+    /**
+     * Pops up to max_count elements under a single lock acquisition.
+     * Does not block.
+     *
+     * @param out       Output iterator the popped elements are moved into.
+     * @param max_count The maximal number of elements to pop.
+     * @return The number of popped elements.
+     */
+    template <typename OutputIt>
+    size_t try_pop_bulk(OutputIt out, size_t max_count);
+
     boost::optional<T> timed_pop(double timeout);
 
     /**
@@ -40,6 +40,19 @@ boost::optional<T> squeue<T, Mutex, ConditionVar>::try_pop() {
     return inner_pop();
 }
 
+template <typename T, typename Mutex, typename ConditionVar>
+template <typename OutputIt>
+size_t squeue<T, Mutex, ConditionVar>::try_pop_bulk(
+    OutputIt out, size_t max_count
+) {
+    std::unique_lock<mutex_t> lock(m_mutex);
+    size_t popped = 0;
+    for (; popped < max_count && !m_queue.empty(); ++popped) {
+        *out++ = inner_pop();
+    }
+    return popped;
+}
+
 template <typename T, typename Mutex, typename ConditionVar>
 boost::optional<T> squeue<T, Mutex, ConditionVar>::timed_pop(double timeout) {
     using std::chrono::microseconds;